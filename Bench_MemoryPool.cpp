@@ -0,0 +1,866 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MemAllocator.h"
+
+
+using namespace pi;
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief the shared layer as it was before the lock-free lists: one free
+///        list per size class behind a check-then-set atomic_bool flag.
+///        kept here only as the reference column of the scaling benchmark
+////////////////////////////////////////////////////////////////////////////////
+class SpinFlagPool {
+public:
+    enum {
+        ALIGN = 8,
+        MAX_BYTES = 256,
+        NFREELISTS = MAX_BYTES / ALIGN
+    };
+
+    static SpinFlagPool& Instance() {
+        static SpinFlagPool theOneAndOnly;
+        return theOneAndOnly;
+    }
+
+    void* allocate(size_t n) {
+        if(n > (size_t)MAX_BYTES) return malloc(n);
+        int idx = (n + ALIGN - 1) / ALIGN - 1;
+        while(free_listRD[idx] == false) std::this_thread::yield();
+        free_listRD[idx] = false;
+        obj* result = free_list[idx];
+        if(result == 0) {
+            free_listRD[idx] = true;
+            return malloc((idx + 1) * ALIGN);
+        }
+        free_list[idx] = result->free_list_link;
+        free_listRD[idx] = true;
+        return result;
+    }
+
+    void deallocate(void* p, size_t n) {
+        if(n > (size_t)MAX_BYTES) {
+            free(p);
+            return;
+        }
+        int idx = (n + ALIGN - 1) / ALIGN - 1;
+        while(free_listRD[idx] == false) std::this_thread::yield();
+        free_listRD[idx] = false;
+        ((obj*)p)->free_list_link = free_list[idx];
+        free_list[idx] = (obj*)p;
+        free_listRD[idx] = true;
+    }
+
+private:
+    SpinFlagPool() {
+        for(int i = 0; i < NFREELISTS; ++i) {
+            free_list[i] = 0;
+            free_listRD[i] = true;
+        }
+    }
+
+    union obj {
+        union obj* free_list_link;
+        char  client[1];
+    };
+
+    obj* volatile     free_list[NFREELISTS];
+    std::atomic_bool  free_listRD[NFREELISTS];
+};
+
+
+struct PoolPolicy {
+    static const char* name() { return "Alloc"; }
+    static void* allocate(size_t n) { return Alloc::allocate(n); }
+    static void  deallocate(void* p, size_t n) { Alloc::deallocate(p, n); }
+};
+
+struct SpinFlagPolicy {
+    static const char* name() { return "spin-flag"; }
+    static void* allocate(size_t n) { return SpinFlagPool::Instance().allocate(n); }
+    static void  deallocate(void* p, size_t n) { SpinFlagPool::Instance().deallocate(p, n); }
+};
+
+struct MallocPolicy {
+    static const char* name() { return "malloc"; }
+    static void* allocate(size_t n) { return malloc(n); }
+    static void  deallocate(void* p, size_t) { free(p); }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+struct Options {
+    int         maxThreads;
+    size_t      ops;                ///< operations of a benchmark, split over its threads
+    std::string json;               ///< write the results to this file as well
+};
+
+struct Result {
+    std::string name;
+    std::string allocator;
+    int         threads;
+    size_t      ops;
+    double      seconds;
+    double      p50, p99, p999;     ///< latency of one operation in ns
+};
+
+static std::vector<Result> g_results;
+static bool g_failures = false;         ///< a benchmark found wrong results, main fails
+
+typedef std::chrono::steady_clock Clock;
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief latency samples of one thread. timing every operation would mostly
+///        measure the clock, so only every SAMPLE_EVERY-th one is timed
+////////////////////////////////////////////////////////////////////////////////
+class Latency {
+public:
+    enum {
+        SAMPLE_EVERY = 16
+    };
+
+    Latency() : tick(0) {}
+
+    template <typename F>
+    void measure(F f) {
+        if(++tick % SAMPLE_EVERY) {
+            f();
+            return;
+        }
+        Clock::time_point t0 = Clock::now();
+        f();
+        samples.push_back((float)std::chrono::duration<double, std::nano>(Clock::now() - t0).count());
+    }
+
+    std::vector<float> samples;
+
+private:
+    unsigned tick;
+};
+
+static double percentile(std::vector<float>& v, double q)
+{
+    if(v.empty()) return 0;
+    size_t k = std::min(v.size() - 1, (size_t)(q * v.size()));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief start nthreads running body(thread, latency), time them from a
+///        common start signal and record throughput and latency percentiles
+////////////////////////////////////////////////////////////////////////////////
+template <typename Body>
+void run(const char* name, const char* allocator, int nthreads, size_t ops, Body body)
+{
+    std::vector<Latency> latency(nthreads);
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+
+    for(int t = 0; t < nthreads; ++t) {
+        threads.push_back(std::thread([&, t]() {
+            ++ready;
+            while(!go) std::this_thread::yield();
+            body(t, latency[t]);
+        }));
+    }
+
+    while(ready != nthreads) std::this_thread::yield();
+    Clock::time_point start = Clock::now();
+    go = true;
+    for(size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<float> all;
+    for(size_t i = 0; i < latency.size(); ++i)
+        all.insert(all.end(), latency[i].samples.begin(), latency[i].samples.end());
+
+    Result r;
+    r.name = name;
+    r.allocator = allocator;
+    r.threads = nthreads;
+    r.ops = ops;
+    r.seconds = seconds;
+    r.p50 = percentile(all, 0.50);
+    r.p99 = percentile(all, 0.99);
+    r.p999 = percentile(all, 0.999);
+    g_results.push_back(r);
+
+    printf("%-22s %-18s %4d threads %10.2f Mops/s  p50 %7.0f ns  p99 %7.0f ns  p99.9 %7.0f ns\n",
+           name, allocator, nthreads, ops / seconds / 1e6, r.p50, r.p99, r.p999);
+    fflush(stdout);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief every thread keeps a ring of `depth` live small objects and replaces
+///        the oldest one per step; a ring deeper than the thread caches also
+///        pushes traffic through the shared free lists
+////////////////////////////////////////////////////////////////////////////////
+template <typename Policy>
+void churn(const char* name, int nthreads, size_t ops, int depth)
+{
+    static const size_t sizes[] = {16, 24, 32, 48, 64, 96, 128, 256};
+    size_t per_thread = ops / nthreads / 2;
+
+    run(name, Policy::name(), nthreads, per_thread * nthreads * 2, [&](int t, Latency& lat) {
+        std::vector<void*> ring(depth, (void*)0);
+        std::vector<size_t> ringSize(depth, 0);
+        for(size_t i = 0; i < per_thread; ++i) {
+            size_t k = i % depth;
+            size_t sz = sizes[(i + t) & 7];
+            if(ring[k]) lat.measure([&]() {Policy::deallocate(ring[k], ringSize[k]);});
+            lat.measure([&]() {ring[k] = Policy::allocate(sz);});
+            ringSize[k] = sz;
+        }
+        for(int k = 0; k < depth; ++k)
+            if(ring[k]) Policy::deallocate(ring[k], ringSize[k]);
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief pairs of threads: the producer allocates, the consumer frees what
+///        the producer allocated, through a single-producer single-consumer ring
+////////////////////////////////////////////////////////////////////////////////
+template <typename Policy>
+void producerConsumer(int npairs, size_t ops)
+{
+    enum { QUEUE = 1024, SIZE = 64 };
+
+    struct Queue {
+        void*               slot[QUEUE];
+        std::atomic<size_t> head, tail;
+        Queue() : head(0), tail(0) {}
+    };
+
+    std::vector<Queue> queues(npairs);
+    size_t per_pair = ops / npairs / 2;
+
+    run("producer-consumer", Policy::name(), npairs * 2, per_pair * npairs * 2, [&](int t, Latency& lat) {
+        Queue& q = queues[t / 2];
+        if(t % 2 == 0) {
+            for(size_t i = 0; i < per_pair; ++i) {
+                void* p = 0;
+                lat.measure([&]() {p = Policy::allocate(SIZE);});
+                size_t tail = q.tail.load(std::memory_order_relaxed);
+                while(tail - q.head.load(std::memory_order_acquire) == QUEUE) std::this_thread::yield();
+                q.slot[tail % QUEUE] = p;
+                q.tail.store(tail + 1, std::memory_order_release);
+            }
+        }
+        else {
+            for(size_t i = 0; i < per_pair; ++i) {
+                size_t head = q.head.load(std::memory_order_relaxed);
+                while(q.tail.load(std::memory_order_acquire) == head) std::this_thread::yield();
+                void* p = q.slot[head % QUEUE];
+                q.head.store(head + 1, std::memory_order_release);
+                lat.measure([&]() {Policy::deallocate(p, SIZE);});
+            }
+        }
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief random sizes, mostly small with a tail up to 256 KB, freed in
+///        random order from a working set of 1024 objects per thread
+////////////////////////////////////////////////////////////////////////////////
+template <typename Policy>
+void mixed(int nthreads, size_t ops)
+{
+    enum { WORKING_SET = 1024 };
+    size_t per_thread = ops / nthreads / 2;
+
+    run("mixed-sizes", Policy::name(), nthreads, per_thread * nthreads * 2, [&](int t, Latency& lat) {
+        std::vector<void*> live(WORKING_SET, (void*)0);
+        std::vector<size_t> liveSize(WORKING_SET, 0);
+        unsigned seed = 12345u + t;
+
+        for(size_t i = 0; i < per_thread; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            size_t k = (seed >> 8) % WORKING_SET;
+            unsigned r = (seed >> 16) % 1000;
+            size_t sz = r < 900 ? 8 + r % 256 : r < 990 ? 256 + (seed % 32768) : 32768 + (seed % 262144);
+
+            if(live[k]) lat.measure([&]() {Policy::deallocate(live[k], liveSize[k]);});
+            lat.measure([&]() {live[k] = Policy::allocate(sz);});
+            liveSize[k] = sz;
+        }
+        for(int k = 0; k < WORKING_SET; ++k)
+            if(live[k]) Policy::deallocate(live[k], liveSize[k]);
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief every thread builds up a live set of 1 to 4 KB objects and frees it
+///        only at the end, so refills keep taking fresh superblocks. the tail
+///        latency shows the waits for mmap and page faults, which provisioning
+///        moves to a background thread. each run starts from a trimmed pool
+////////////////////////////////////////////////////////////////////////////////
+template <typename Policy>
+void growth(int nthreads, size_t ops, size_t provision_bytes)
+{
+    size_t per_thread = ops / nthreads;
+    Alloc::trim();
+    Alloc::setProvisioning(provision_bytes);
+
+    run("heap-growth", provision_bytes ? "Alloc+provision" : Policy::name(), nthreads, per_thread * nthreads,
+        [&](int t, Latency& lat) {
+        std::vector<void*> live(per_thread);
+        for(size_t i = 0; i < per_thread; ++i) {
+            size_t sz = 1024 + ((i * 2654435761u + t) & 3071);
+            lat.measure([&]() {live[i] = Policy::allocate(sz);});
+            memset(live[i], (int)i, 64);
+        }
+        for(size_t i = 0; i < per_thread; ++i)
+            Policy::deallocate(live[i], 1024 + ((i * 2654435761u + t) & 3071));
+    });
+
+    Alloc::setProvisioning(0);
+}
+
+
+
+struct Item {
+    float x, y, z;
+    int   id;
+    Item() : x(0), y(0), z(0), id(0) {}
+};
+
+struct PoolBuffers {
+    static const char* name() { return "MemAllocator"; }
+    static Item* get(size_t n) { return MemAllocator<Item>::Instance().getBuffer(n); }
+    static void  put(Item* p, size_t) { MemAllocator<Item>::Instance().returnBuffer(p); }
+};
+
+struct HeapBuffers {
+    static const char* name() { return "new[]"; }
+    static Item* get(size_t n) { return new Item[n]; }
+    static void  put(Item* p, size_t) { delete[] p; }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief the buffer recycling as it was before the thread caches: every get
+///        and return goes through one mutex. the reference column of the
+///        contention benchmark
+////////////////////////////////////////////////////////////////////////////////
+struct LockedBuffers {
+    static const char* name() { return "one-mutex"; }
+
+    static Item* get(size_t n) {
+        {
+            std::unique_lock<std::mutex> lock(mutex());
+            std::vector<Item*>& v = available()[n];
+            if(!v.empty()) {
+                Item* p = v.back();
+                v.pop_back();
+                return p;
+            }
+        }
+        return new Item[n];
+    }
+
+    static void put(Item* p, size_t n) {
+        std::unique_lock<std::mutex> lock(mutex());
+        available()[n].push_back(p);
+    }
+
+    static std::mutex& mutex() { static std::mutex m; return m; }
+    static std::map<size_t, std::vector<Item*> >& available() {
+        static std::map<size_t, std::vector<Item*> > a;
+        return a;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief getBuffer/returnBuffer cycles of a few buffer lengths
+////////////////////////////////////////////////////////////////////////////////
+template <typename Policy>
+void bufferCycles(int nthreads, size_t ops)
+{
+    static const size_t lengths[] = {1, 4, 16, 64, 256, 1024};
+    size_t per_thread = ops / nthreads / 2;
+
+    run("buffer-cycles", Policy::name(), nthreads, per_thread * nthreads * 2, [&](int t, Latency& lat) {
+        for(size_t i = 0; i < per_thread; ++i) {
+            size_t n = lengths[(i + t) % 6];
+            Item* p = 0;
+            lat.measure([&]() {p = Policy::get(n);});
+            p[n - 1].id = (int)i;
+            lat.measure([&]() {Policy::put(p, n);});
+        }
+    });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief every thread cycles buffers of a few lengths and hands every
+///        eighth one to its neighbour, which returns it on its own thread
+////////////////////////////////////////////////////////////////////////////////
+template <typename Policy>
+void bufferContention(int nthreads, size_t ops)
+{
+    enum { HANDOFF = 64 };
+    static const size_t lengths[] = {4, 16, 64, 256};
+    std::vector<std::atomic<Item*> > slots(nthreads);
+    for(int t = 0; t < nthreads; ++t) slots[t] = 0;
+    size_t per_thread = ops / nthreads / 2;
+
+    run("buffer-contention", Policy::name(), nthreads, per_thread * nthreads * 2, [&](int t, Latency& lat) {
+        for(size_t i = 0; i < per_thread; ++i) {
+            size_t n = (i % 8 == 0) ? (size_t)HANDOFF : lengths[(i + t) % 4];
+            Item* p = 0;
+            lat.measure([&]() {p = Policy::get(n);});
+            p[n - 1].id = (int)i;
+            if(n == HANDOFF) {
+                p = slots[(t + 1) % nthreads].exchange(p);
+                if(p == 0) continue;
+            }
+            lat.measure([&]() {Policy::put(p, n);});
+        }
+    });
+
+    for(int t = 0; t < nthreads; ++t)
+        if(Item* p = slots[t].exchange(0)) Policy::put(p, HANDOFF);
+}
+
+
+struct FramePool {
+    static const char* name() { return "Alloc"; }
+    void* get(size_t n) { return Alloc::allocate(n); }
+    void  put(void* p, size_t n) { Alloc::deallocate(p, n); }
+    void  endFrame() {}
+};
+
+struct FrameMalloc {
+    static const char* name() { return "malloc"; }
+    void* get(size_t n) { return malloc(n); }
+    void  put(void* p, size_t) { free(p); }
+    void  endFrame() {}
+};
+
+struct FrameArena {
+    static const char* name() { return "Arena"; }
+    void* get(size_t n) { return arena.allocate(n); }
+    void  put(void*, size_t) {}
+    void  endFrame() { arena.reset(); }
+
+    InlineArena<16384> arena;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief frames of OBJECTS small allocations that all die at the end of the
+///        frame, freed one by one or dropped with the arena. the latency
+///        columns are per frame, allocations and teardown together
+////////////////////////////////////////////////////////////////////////////////
+template <typename Policy>
+void frames(size_t ops)
+{
+    enum { OBJECTS = 1000 };
+    static const size_t sizes[] = {16, 24, 32, 48, 64, 96, 128, 256};
+    size_t nframes = ops / OBJECTS;
+    Policy policy;
+    std::vector<void*> live(OBJECTS);
+
+    run("frame", Policy::name(), 1, nframes * OBJECTS, [&](int, Latency& lat) {
+        for(size_t f = 0; f < nframes; ++f) {
+            lat.measure([&]() {
+                for(int i = 0; i < OBJECTS; ++i) {
+                    live[i] = policy.get(sizes[i & 7]);
+                    *(char*)live[i] = (char)i;
+                }
+                for(int i = 0; i < OBJECTS; ++i)
+                    policy.put(live[i], sizes[i & 7]);
+                policy.endFrame();
+            });
+        }
+    });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief node based containers: insert N keys in scrambled order and erase
+///        them again, push N elements to a list and pop them again
+////////////////////////////////////////////////////////////////////////////////
+template <typename Map>
+void mapInsertErase(const char* allocator, Map& m, size_t ops)
+{
+    size_t n = ops / 2;
+
+    run("map-insert-erase", allocator, 1, n * 2, [&](int, Latency& lat) {
+        for(size_t i = 0; i < n; ++i) {
+            int key = (int)((i * 2654435761u) % n);
+            lat.measure([&]() {m.insert(std::make_pair(key, (int)i));});
+        }
+        for(size_t i = 0; i < n; ++i) {
+            int key = (int)((i * 2654435761u) % n);
+            lat.measure([&]() {m.erase(key);});
+        }
+    });
+}
+
+template <typename List>
+void listPushPop(const char* allocator, List& l, size_t ops)
+{
+    enum { DEPTH = 4096 };
+    size_t rounds = std::max(ops / DEPTH / 2, (size_t)1);
+
+    run("list-push-pop", allocator, 1, rounds * DEPTH * 2, [&](int, Latency& lat) {
+        for(size_t r = 0; r < rounds; ++r) {
+            for(int i = 0; i < DEPTH; ++i)
+                lat.measure([&]() {l.push_back(i);});
+            for(int i = 0; i < DEPTH; ++i)
+                lat.measure([&]() {l.pop_front();});
+        }
+    });
+}
+
+static void containers(size_t ops)
+{
+    typedef std::pair<const int, int> Node;
+
+    {
+        std::map<int, int> m;
+        mapInsertErase("std::allocator", m, ops);
+    }
+    {
+        std::map<int, int, std::less<int>, PoolAllocator<Node> > m;
+        mapInsertErase("PoolAllocator", m, ops);
+    }
+    {
+        std::list<int> l;
+        listPushPop("std::allocator", l, ops);
+    }
+    {
+        std::list<int, PoolAllocator<int> > l;
+        listPushPop("PoolAllocator", l, ops);
+    }
+#ifdef PI_HAS_MEMORY_RESOURCE
+    {
+        std::pmr::map<int, int> m(PoolResource::Instance());
+        mapInsertErase("PoolResource", m, ops);
+    }
+    {
+        std::pmr::list<int> l(PoolResource::Instance());
+        listPushPop("PoolResource", l, ops);
+    }
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief every step replaces the oldest of a ring of live smart pointers,
+///        one creation and one destruction
+////////////////////////////////////////////////////////////////////////////////
+template <typename Ptr, typename Make>
+void smartPointer(const char* allocator, size_t ops, Make make)
+{
+    enum { DEPTH = 256 };
+    std::vector<Ptr> ring(DEPTH);
+
+    run("smart-pointer", allocator, 1, ops, [&](int, Latency& lat) {
+        for(size_t i = 0; i < ops; ++i)
+            lat.measure([&]() {ring[i % DEPTH] = make();});
+    });
+}
+
+static void smartPointers(size_t ops)
+{
+    smartPointer<std::unique_ptr<Item> >("make_unique", ops, []() {return std::make_unique<Item>();});
+    smartPointer<pooled_ptr<Item> >("make_pooled", ops, []() {return make_pooled<Item>();});
+    smartPointer<std::shared_ptr<Item> >("make_shared", ops, []() {return std::make_shared<Item>();});
+    smartPointer<std::shared_ptr<Item> >("make_shared_pooled", ops, []() {return make_shared_pooled<Item>();});
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief every thread allocates BATCH objects of 64 bytes and frees them
+///        again, with allocate_batch/deallocate_batch or one call per object.
+///        far more than a thread cache holds, so the objects pass through the
+///        shared list. the latency columns are per call, i.e. per batch for
+///        the batch calls
+////////////////////////////////////////////////////////////////////////////////
+enum { BATCH = 1000, BATCH_SIZE = 64 };
+
+static void batches(int nthreads, size_t ops)
+{
+    size_t rounds = std::max(ops / nthreads / BATCH / 2, (size_t)1);
+
+    run("batch", "allocate_batch", nthreads, rounds * BATCH * nthreads * 2, [&](int, Latency& lat) {
+        std::vector<void*> live(BATCH);
+        for(size_t r = 0; r < rounds; ++r) {
+            lat.measure([&]() {Alloc::allocate_batch(BATCH_SIZE, BATCH, live.data());});
+            lat.measure([&]() {Alloc::deallocate_batch(live.data(), BATCH, BATCH_SIZE);});
+        }
+    });
+
+    run("batch", "Alloc one by one", nthreads, rounds * BATCH * nthreads * 2, [&](int, Latency& lat) {
+        std::vector<void*> live(BATCH);
+        for(size_t r = 0; r < rounds; ++r) {
+            for(int i = 0; i < BATCH; ++i)
+                lat.measure([&]() {live[i] = Alloc::allocate(BATCH_SIZE);});
+            for(int i = 0; i < BATCH; ++i)
+                lat.measure([&]() {Alloc::deallocate(live[i], BATCH_SIZE);});
+        }
+    });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief a capture process hands 1080p frames to a consumer process: copied
+///        through a unix socket, or as a SharedPool handle the consumer maps at
+///        its own address. the consumer reads every byte of a frame and acks
+///        whether it was intact. the latency columns are per frame, from filling
+///        it to the consumer's ack; the ops are bytes, so Mops/s reads as MB/s
+////////////////////////////////////////////////////////////////////////////////
+enum { FRAME_BYTES = 1920 * 1080 * 3 };
+
+static bool sendAll(int fd, const void* data, size_t n)
+{
+    for(size_t done = 0; done < n;) {
+        ssize_t k = write(fd, (const char*)data + done, n - done);
+        if(k <= 0) return false;
+        done += k;
+    }
+    return true;
+}
+
+static bool receiveAll(int fd, void* data, size_t n)
+{
+    for(size_t done = 0; done < n;) {
+        ssize_t k = read(fd, (char*)data + done, n - done);
+        if(k <= 0) return false;
+        done += k;
+    }
+    return true;
+}
+
+static bool filledWith(const char* frame, size_t n, char value)
+{
+    for(size_t i = 0; i < n; ++i)
+        if(frame[i] != value) return false;
+    return true;
+}
+
+struct SocketFrames {
+    static const char* name() { return "socket copy"; }
+
+    SocketFrames() : frame(FRAME_BYTES) {}
+
+    bool produce(int sock, char value) {
+        memset(frame.data(), value, FRAME_BYTES);
+        return sendAll(sock, &value, 1) && sendAll(sock, frame.data(), FRAME_BYTES);
+    }
+
+    /// -1 when the producer is gone, else whether the frame came intact
+    int consume(int sock) {
+        char value;
+        if(!receiveAll(sock, &value, 1) || !receiveAll(sock, frame.data(), FRAME_BYTES)) return -1;
+        return filledWith(frame.data(), FRAME_BYTES, value);
+    }
+
+    size_t leaked() const { return 0; }
+
+    std::vector<char> frame;
+};
+
+struct SharedFrames {
+    static const char* name() { return "SharedPool"; }
+
+    SharedFrames() : pool(SharedPool::create(0, 16 * FRAME_BYTES)), view(0) {}
+    ~SharedFrames() { delete view; delete pool; }
+
+    bool produce(int sock, char value) {
+        SharedPool::Handle h = pool ? pool->getBuffer(FRAME_BYTES) : 0;
+        if(h == 0) return false;
+        memset(pool->resolve(h), value, FRAME_BYTES);
+        return sendAll(sock, &value, 1) && sendAll(sock, &h, sizeof(h));
+    }
+
+    /// the consumer maps the memfd again, at another address than the producer,
+    /// and returns the buffer from there
+    int consume(int sock) {
+        if(view == 0 && (pool == 0 || (view = SharedPool::open(pool->fd())) == 0)) return -1;
+        char value;
+        SharedPool::Handle h;
+        if(!receiveAll(sock, &value, 1) || !receiveAll(sock, &h, sizeof(h))) return -1;
+        char* frame = (char*)view->resolve(h);
+        bool ok = frame != 0 && filledWith(frame, FRAME_BYTES, value);
+        view->returnBuffer(h);
+        return ok;
+    }
+
+    /// buffers the consumer did not give back
+    size_t leaked() const { return pool ? pool->buffers() : 0; }
+
+    SharedPool* pool;
+    SharedPool* view;
+};
+
+template <typename Exchange>
+void frameExchange(size_t frames)
+{
+    Exchange exchange;
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return;
+
+    // a consumer that died shows up as a failed write, not as SIGPIPE
+    void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    pid_t consumer = fork();
+    if(consumer == 0) {
+        close(sv[0]);
+        int ok;
+        while((ok = exchange.consume(sv[1])) >= 0) {
+            char ack = (char)ok;
+            if(write(sv[1], &ack, 1) != 1) break;
+        }
+        _exit(0);
+    }
+    close(sv[1]);
+
+    size_t sent = 0, corrupted = 0;
+    bool broken = false;
+    run("frame-exchange", Exchange::name(), 1, frames * FRAME_BYTES, [&](int, Latency& lat) {
+        for(size_t f = 0; f < frames && !broken; ++f) {
+            lat.measure([&]() {
+                char ack;
+                broken = !exchange.produce(sv[0], (char)f) || !receiveAll(sv[0], &ack, 1);
+                if(broken) return;
+                ++sent;
+                if(!ack) ++corrupted;
+            });
+        }
+    });
+
+    close(sv[0]);
+    waitpid(consumer, 0, 0);
+    signal(SIGPIPE, sigpipe);
+
+    if(broken || corrupted != 0 || exchange.leaked() != 0) {
+        printf("%-22s %-18s FAILED: %zu of %zu frames sent, %zu corrupted, %zu buffers not returned\n",
+               "frame-exchange", Exchange::name(), sent, frames, corrupted, exchange.leaked());
+        g_failures = true;
+    }
+}
+
+
+static void writeJSON(const std::string& path)
+{
+    FILE* f = fopen(path.c_str(), "w");
+    if(f == 0) {
+        printf("can not write %s\n", path.c_str());
+        return;
+    }
+
+    fprintf(f, "{\n  \"results\": [\n");
+    for(size_t i = 0; i < g_results.size(); ++i) {
+        const Result& r = g_results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"allocator\": \"%s\", \"threads\": %d, \"ops\": %zu, "
+                   "\"seconds\": %.6f, \"mops\": %.3f, \"p50_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f}%s\n",
+                r.name.c_str(), r.allocator.c_str(), r.threads, r.ops, r.seconds,
+                r.ops / r.seconds / 1e6, r.p50, r.p99, r.p999,
+                i + 1 < g_results.size() ? "," : "");
+    }
+    fprintf(f, "  ],\n  \"alloc_stats\": %s\n}\n", Alloc::stats().toJSON().c_str());
+    fclose(f);
+}
+
+static Options parse(int argc, char** argv)
+{
+    Options opt;
+    opt.maxThreads = 64;
+    opt.ops = 4000000;
+
+    for(int i = 1; i < argc; ++i) {
+        if(strncmp(argv[i], "--threads=", 10) == 0)
+            opt.maxThreads = atoi(argv[i] + 10);
+        else if(strncmp(argv[i], "--ops=", 6) == 0)
+            opt.ops = strtoull(argv[i] + 6, 0, 10);
+        else if(strncmp(argv[i], "--json=", 7) == 0)
+            opt.json = argv[i] + 7;
+        else {
+            printf("usage: %s [--threads=N] [--ops=N] [--json=file]\n", argv[0]);
+            exit(1);
+        }
+    }
+    return opt;
+}
+
+
+int main(int argc, char** argv)
+{
+    Options opt = parse(argc, argv);
+
+    churn<PoolPolicy>("churn", 1, opt.ops, 64);
+    churn<MallocPolicy>("churn", 1, opt.ops, 64);
+
+    for(int n = 1; n <= opt.maxThreads; n *= 2) {
+        churn<PoolPolicy>("scaling", n, opt.ops, 256);
+        churn<SpinFlagPolicy>("scaling", n, opt.ops, 256);
+        churn<MallocPolicy>("scaling", n, opt.ops, 256);
+    }
+
+    for(int n = 1; n * 2 <= opt.maxThreads && n <= 8; n *= 2) {
+        producerConsumer<PoolPolicy>(n, opt.ops);
+        producerConsumer<MallocPolicy>(n, opt.ops);
+    }
+
+    for(int n = 1; n <= std::min(opt.maxThreads, 4); n *= 4)
+        batches(n, opt.ops);
+
+    mixed<PoolPolicy>(1, opt.ops);
+    mixed<MallocPolicy>(1, opt.ops);
+    mixed<PoolPolicy>(std::min(opt.maxThreads, 8), opt.ops);
+    mixed<MallocPolicy>(std::min(opt.maxThreads, 8), opt.ops);
+
+    for(int n = 1; n <= std::min(opt.maxThreads, 4); n *= 4) {
+        growth<PoolPolicy>(n, opt.ops / 32, 0);
+        growth<PoolPolicy>(n, opt.ops / 32, 32 << 20);
+        growth<MallocPolicy>(n, opt.ops / 32, 0);
+    }
+
+    bufferCycles<PoolBuffers>(1, opt.ops / 4);
+    bufferCycles<HeapBuffers>(1, opt.ops / 4);
+
+    for(int n = 1; n <= opt.maxThreads; n *= 2) {
+        bufferContention<PoolBuffers>(n, opt.ops / 2);
+        bufferContention<LockedBuffers>(n, opt.ops / 2);
+        bufferContention<HeapBuffers>(n, opt.ops / 2);
+    }
+
+    frames<FramePool>(opt.ops);
+    frames<FrameMalloc>(opt.ops);
+    frames<FrameArena>(opt.ops);
+
+    containers(opt.ops / 4);
+    smartPointers(opt.ops / 2);
+
+    frameExchange<SocketFrames>(opt.ops / 8000);
+    frameExchange<SharedFrames>(opt.ops / 8000);
+
+    if(!opt.json.empty())
+        writeJSON(opt.json);
+
+    return g_failures ? 1 : 0;
+}
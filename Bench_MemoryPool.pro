@@ -0,0 +1,15 @@
+QMAKE_CXXFLAGS += -std=c++11 -O2
+
+OBJECTS_DIR = ./build_bench
+TARGET = Bench_MemoryPool
+
+
+HEADERS += \
+    MemAllocator.h
+
+SOURCES += \
+    Bench_MemoryPool.cpp \
+    MemAllocator.cpp
+
+QMAKE_LFLAGS += -Wl,--no-as-needed
+LIBS += -lpthread -ldl -lrt
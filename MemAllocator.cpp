@@ -1,4 +1,21 @@
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include "MemAllocator.h"
 
 namespace pi {
@@ -9,9 +26,202 @@ namespace pi {
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-int g_defaultNodeNum = 20;          ///< default list node size
 int g_InitPoolSize = 2048;          ///< initial pool memory size
 
+size_t g_largeCacheLimit = 64 << 20;    ///< bytes of freed large spans kept mapped
+int    g_largeCacheDecay = 10000;       ///< milliseconds a freed large span stays cached
+bool   g_largeHugePage = false;         ///< 2 MB align large spans and advise huge pages
+
+int    g_scavengeInterval = 0;          ///< milliseconds between background trims, 0 is off
+size_t g_scavengeIdle = 0;              ///< free superblock bytes the scavenger keeps resident
+
+std::atomic<size_t> g_provisionLow(0);  ///< resident free superblock bytes per arena below which the provisioner refills, 0 is off
+std::atomic<size_t> g_provisionHigh(0); ///< resident free superblock bytes per arena the provisioner fills up to
+
+int    g_numaSimulated = 0;             ///< nodes simulated for testing, 0 uses the real topology
+
+std::atomic<size_t> g_sampleInterval(0);    ///< mean bytes between two heap samples, 0 is off
+std::atomic<size_t> g_liveSamples(0);       ///< sampled allocations not freed yet
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// every call into the OS for memory goes through these, so that the bytes
+/// held from the OS, its high-water mark and the number of syscalls are known
+////////////////////////////////////////////////////////////////////////////////
+
+std::atomic<size_t> g_osBytes(0);
+std::atomic<size_t> g_osPeak(0);
+std::atomic<size_t> g_osCalls(0);
+
+static void TrackOS(size_t add, size_t sub)
+{
+    size_t now = g_osBytes.fetch_add(add - sub, std::memory_order_relaxed) + add - sub;
+    size_t peak = g_osPeak.load(std::memory_order_relaxed);
+    while(now > peak && !g_osPeak.compare_exchange_weak(peak, now, std::memory_order_relaxed));
+}
+
+/// map bytes of fresh memory aligned to align (a power of two, 0 for page alignment)
+static void* OsMap(size_t bytes, size_t align)
+{
+    size_t reserve = align ? bytes + align : bytes;
+    char* p = (char*)mmap(0, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    g_osCalls.fetch_add(1, std::memory_order_relaxed);
+    if(p == MAP_FAILED) return 0;
+
+    char* aligned = p;
+    if(align) {
+        // over-mapped by align bytes, cut the mapping down to the aligned part
+        aligned = (char*)(((uintptr_t)p + align - 1) & ~((uintptr_t)align - 1));
+        if(aligned != p) munmap(p, aligned - p);
+        if(p + reserve != aligned + bytes) munmap(aligned + bytes, p + reserve - (aligned + bytes));
+        g_osCalls.fetch_add(2, std::memory_order_relaxed);
+    }
+
+    TrackOS(bytes, 0);
+    return aligned;
+}
+
+/// prefer the pages of [p, p+bytes) on a NUMA node, pages are placed when first touched
+static void OsBind(void* p, size_t bytes, int node)
+{
+#ifdef SYS_mbind
+    const int MPOL_PREFERRED_ = 1;
+    unsigned long mask[64 / (8 * sizeof(unsigned long)) + 1] = {0};
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, p, bytes, MPOL_PREFERRED_, mask, sizeof(mask) * 8, 0);
+    g_osCalls.fetch_add(1, std::memory_order_relaxed);
+#else
+    (void)p; (void)bytes; (void)node;
+#endif
+}
+
+/// the NUMA node the calling thread runs on
+static int OsCurrentNode()
+{
+#ifdef SYS_getcpu
+    unsigned cpu = 0, node = 0;
+    if(syscall(SYS_getcpu, &cpu, &node, 0) == 0) return (int)node;
+#endif
+    return 0;
+}
+
+/// the number of NUMA nodes online, 1 without NUMA. read without stdio, which
+/// would malloc while the default heap is still being built under LD_PRELOAD
+static int OsNodes()
+{
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return 1;
+    char text[256];
+    ssize_t len = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if(len <= 0) return 1;
+    text[len] = 0;
+
+    // a list of ranges such as "0-1,3", the highest node decides
+    int nodes = 1, last = -1;
+    for(const char* c = text; *c; ++c) {
+        if(*c < '0' || *c > '9') continue;
+        last = 0;
+        while(*c >= '0' && *c <= '9')
+            last = last * 10 + (*c++ - '0');
+        if(last + 1 > nodes) nodes = last + 1;
+        if(*c == 0) break;
+    }
+    return nodes;
+}
+
+static void OsUnmap(void* p, size_t bytes)
+{
+    munmap(p, bytes);
+    g_osCalls.fetch_add(1, std::memory_order_relaxed);
+    TrackOS(0, bytes);
+}
+
+static void* OsRemap(void* p, size_t old_bytes, size_t new_bytes)
+{
+    void* result = mremap(p, old_bytes, new_bytes, MREMAP_MAYMOVE);
+    g_osCalls.fetch_add(1, std::memory_order_relaxed);
+    if(result == MAP_FAILED) return 0;
+
+    TrackOS(new_bytes, old_bytes);
+    return result;
+}
+
+/// give the pages back but keep the range mapped
+static void OsDecommit(void* p, size_t bytes)
+{
+    madvise(p, bytes, MADV_DONTNEED);
+    g_osCalls.fetch_add(1, std::memory_order_relaxed);
+    TrackOS(0, bytes);
+}
+
+/// a decommitted range is about to be used again
+static void OsRecommit(size_t bytes)
+{
+    TrackOS(bytes, 0);
+}
+
+/// faults the pages of fresh or decommitted memory in, by writing the zeros they hold anyway
+static void OsPrefault(void* p, size_t bytes)
+{
+    g_osCalls.fetch_add(1, std::memory_order_relaxed);
+#ifdef MADV_POPULATE_WRITE
+    if(madvise(p, bytes, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    for(size_t off = 0; off < bytes; off += 4096)
+        ((volatile char*)p)[off] = 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief radix tree from 4 KB page to what the page holds, so that a pointer
+///        can be freed without its size. three levels of 4096 entries cover
+///        48 bit addresses. readers take no lock: nodes are only ever added
+///        and are published with release stores. an entry is either
+///        (size class << 2) | SMALL for every page of a superblock, or
+///        (span bytes) | LARGE for the first page of a large span.
+////////////////////////////////////////////////////////////////////////////////
+class PageMap {
+public:
+    enum {
+        PAGE_SHIFT = 12,
+        BITS = 12,
+        LENGTH = 1 << BITS,
+        SMALL = 1,
+        LARGE = 2
+    };
+
+    static uintptr_t get(const void* p) {
+        uintptr_t key = (uintptr_t)p >> PAGE_SHIFT;
+        if(key >> (3 * BITS)) return 0;
+        Node* node = root[key >> (2 * BITS)].load(std::memory_order_acquire);
+        if(node == 0) return 0;
+        Leaf* leaf = node->child[(key >> BITS) & (LENGTH - 1)].load(std::memory_order_acquire);
+        if(leaf == 0) return 0;
+        return leaf->value[key & (LENGTH - 1)].load(std::memory_order_relaxed);
+    }
+
+    /// false when the tree could not grow and the caller may fail, see
+    /// AllocPrime::call_oom_handler. clearing entries never fails
+    static bool set(const void* p, size_t bytes, uintptr_t value);
+
+    /// held across fork()
+    static void lock() { mapMutex.lock(); }
+    static void unlock() { mapMutex.unlock(); }
+
+private:
+    struct Leaf {
+        std::atomic<uintptr_t> value[LENGTH];
+    };
+
+    struct Node {
+        std::atomic<Leaf*> child[LENGTH];
+    };
+
+    static std::atomic<Node*> root[LENGTH];
+    static std::mutex         mapMutex;
+};
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -20,33 +230,206 @@ int g_InitPoolSize = 2048;          ///< initial pool memory size
 class AllocPrime {
 public:
     static void* allocate(size_t n);
-    static void* reallocate(void* p, size_t new_sz);
-    static void  deallocate(void *p);
+    static void* reallocate(void* p, size_t old_sz, size_t new_sz);
+    static void  deallocate(void *p, size_t n);
+    static void  release(void *p, size_t n);
     static void (*set_oom_malloc_handler(void (*f)())) ();
 
+    static size_t SpanBytes(size_t n);
+    static size_t PageSize();
+    static bool   call_oom_handler(bool may_fail = false);
+    static size_t trim(size_t limit);
+    static void   stats(AllocStats& st);
+
+    /// held across fork()
+    static void   lock() { cacheMutex.lock(); }
+    static void   unlock() { cacheMutex.unlock(); }
+
 private:
     static void* oom_malloc(size_t n);
-    static void* oom_realloc(void*p, size_t n);
+    static void* oom_realloc(void*p, size_t old_sz, size_t n);
     static void (*malloc_oom_handler) ();
     static std::atomic_bool malloc_oom_handlerRD;
+
+private:
+    enum {
+        HUGE_PAGE = 2 << 20,
+        SPAN_STEPS = 8,                 ///< span sizes are rounded to 8 steps per power of two
+        NBINS = 8 + 8 * 64
+    };
+
+    ///////////////////////////////////////////////////////////
+    /// \brief a freed span waiting in the cache, the bookkeeping
+    ///        lives in the first bytes of the span itself
+    ///////////////////////////////////////////////////////////
+    struct CachedSpan {
+        CachedSpan *bin_prev, *bin_next;
+        CachedSpan *age_prev, *age_next;
+        size_t      bytes;
+        int64_t     stamp;
+    };
+
+    static void* map(size_t bytes);
+    static void  unmap(void* p, size_t bytes);
+    static int   BinIndex(size_t bytes);
+    static int64_t now();
+
+    static void  unlink(CachedSpan* s);
+    static size_t evict(size_t limit, int64_t expire);
+
+    static std::mutex  cacheMutex;
+    static CachedSpan* bins[NBINS];
+    static CachedSpan* oldest;
+    static CachedSpan* newest;
+    static size_t      cached_bytes;
+    static std::atomic<size_t> large_bytes;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief hands out superblocks, the SUPERBLOCK_SIZE aligned pieces of memory
+///        the size classes are carved from. superblocks are mapped in extents
+///        of EXTENT_BLOCKS; fully free superblocks come back here and either
+///        stay resident for reuse or are returned to the OS by scavenge().
+///        returned superblocks remain mapped (MADV_DONTNEED), so a stale read
+///        of a free list link never faults.
+////////////////////////////////////////////////////////////////////////////////
+class PageHeap {
+public:
+    enum {
+        SUPERBLOCK_SIZE = 256 << 10,
+        EXTENT_BLOCKS = 16
+    };
+
+    explicit PageHeap(int node = -1);
+
+    char*  obtain();
+    void   release(char* sb);
+    size_t scavenge(size_t keep_bytes);
+    size_t provision(size_t low_bytes, size_t high_bytes);
+    size_t mapped();
+    void   unmapAll();
+
+    /// held across fork()
+    void   lock() { heapMutex.lock(); }
+    void   unlock() { heapMutex.unlock(); }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    char*  take_cold();
+    char*  map_extent();
+
+private:
+    std::mutex  heapMutex;
+    FreeBlock*  resident;               ///< free superblocks still backed by memory
+    size_t      resident_bytes;
+    FreeBlock*  returned;               ///< free superblocks given back to the OS
+    char        *extent_free;
+    char        *extent_end;
+    size_t      heap_size;              ///< bytes mapped from the OS
+    int         node;                   ///< NUMA node the extents are bound to, -1 for none
+    char**      extents;                ///< every extent mapped, for unmapAll()
+    size_t      nextents;
+    size_t      extents_cap;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief the large spans held by a pi::Heap, so destroying the heap frees
+///        them. an open addressing set of span addresses in OS memory
+////////////////////////////////////////////////////////////////////////////////
+class SpanSet {
+public:
+    SpanSet() : slots(0), cap(0), count(0), used(0) {}
+
+    /// false when the table could not grow and the caller may fail
+    bool insert(void* p);
+    void erase(void* p);
+
+    /// calls f(span) for every span and empties the set
+    template <typename F>
+    void drain(F f);
+
+    /// bytes of all spans
+    size_t bytes();
+
+    /// held across fork()
+    void lock() { mutex.lock(); }
+    void unlock() { mutex.unlock(); }
+
+private:
+    enum {
+        TOMBSTONE = 1                       ///< spans are page aligned, so no span is 1
+    };
+
+    size_t home(uintptr_t key) const {
+        return (size_t)((key >> 12) * 0x9e3779b97f4a7c15ULL) & (cap - 1);
+    }
+
+    bool rehash(size_t new_cap);
+
+private:
+    std::mutex  mutex;
+    uintptr_t*  slots;
+    size_t      cap;
+    size_t      count;                      ///< spans in the set
+    size_t      used;                       ///< spans and tombstones
 };
 
+class ThreadCache;
+
 class AllocImpl {
+    friend class ThreadCache;
+
 public:
     enum {
         ALIGN = 8,
-        MAX_BYTES = 256,
-        NFREELISTS = MAX_BYTES / ALIGN
+        MAX_BYTES = 32768,
+        NFREELISTS = 80,
+        MAX_LINEAR_BYTES = 128,             ///< classes are 8 bytes apart up to here
+        CLASS_STEPS = 8,                    ///< then 8 classes per power of two (<= 12.5% waste)
+        MAX_SMALL_LOOKUP = 1024,
+        CLASS_ARRAY_SIZE = ((MAX_BYTES + 127 + (120 << 7)) >> 7) + 1,
+        REFILL_BYTES = 32768,               ///< a refill batch carves at most this many bytes
+        MIN_BATCH = 2,                      ///< the adaptive batch of a class starts here
+        MAX_BATCH = 256,                    ///< and grows at most to this many objects
+        NATURAL_ALIGN = 64,                 ///< objects of a class sized a multiple of this are aligned to it
+        MAX_NODES = 64,
+        MAX_HEAPS = 64                      ///< heaps with thread caches, more heaps go without
     };
 
 public:
+    /**
+     * @brief a heap, the default one takes its settings from the globals
+     * @param objects a thread cache moves per refill or flush, 0 adapts per class
+     * @param bytes of superblocks mapped up front, -1 follows setInitPoolSize
+     */
+    AllocImpl(int node_num, int init_pool_size);
+
     static AllocImpl& Instance();
     void* allocate(size_t n);
     void  deallocate(void* p, size_t n);
+    void* allocate_aligned(size_t n, size_t alignment);
+    void  deallocate_aligned(void* p, size_t n, size_t alignment);
     void* reallocate(void*p, size_t old_sz, size_t new_sz);
+    void  deallocate(void* p);
+    size_t allocate_batch(size_t n, size_t count, void** out);
+    void  deallocate_batch(void** ptrs, size_t count, size_t n);
+    size_t usable_size(void* p);
+    size_t trim(size_t keep_bytes);
+    size_t provision(size_t low_bytes, size_t high_bytes);
+    int   arenaCount();
+    void  stats(AllocStats& st);
+    int   setNodes(int simulated);
+    int   setNodeNum(int nn, size_t bytes);
+    size_t large_span_bytes() { return large ? large->bytes() : 0; }
+    void  enroll();
+    void  destroy();
+    void  lockAll();
+    void  unlockAll();
 
 private:
-    AllocImpl();
     AllocImpl& operator=(AllocImpl&) {return *this;}
     AllocImpl(AllocImpl&) {}
 
@@ -54,14 +437,35 @@ private:
         return (((bytes) + ALIGN -1) & ~ (ALIGN - 1));
     }
 
-    size_t FreeListIndex(size_t bytes) {
-        return (((bytes) + ALIGN - 1) / ALIGN - 1);
+    /// sizes up to 1024 are looked up at 8 bytes granularity, larger ones at 128
+    static size_t ClassArrayIndex(size_t bytes) {
+        if(bytes <= (size_t)MAX_SMALL_LOOKUP)
+            return (bytes + 7) >> 3;
+        return (bytes + 127 + (120 << 7)) >> 7;
+    }
+
+    int FreeListIndex(size_t bytes) {
+        return class_index[ClassArrayIndex(bytes)];
+    }
+
+    size_t ClassSize(int idx) {
+        return class_size[idx];
+    }
+
+    /// the batch set by setNodeNum for the class, 0 when it adapts
+    int FixedBatch(int idx) {
+        return fixed_batch[idx].load(std::memory_order_relaxed);
     }
 
-    char* chunk_alloc(size_t size, int &nobjs);
-    void* refill(size_t n);
+    /// the largest adaptive batch of the class, REFILL_BYTES worth of objects
+    int BatchLimit(int idx) {
+        return batch_limit[idx];
+    }
 
+    inline ThreadCache* cache();
 
+    void* allocate_large(size_t n);
+    void  deallocate_large(void* p, size_t n);
 
 private:
     union obj {
@@ -69,43 +473,506 @@ private:
         char  client[1];
     };
 
+    ////////////////////////////////////////////////////////////////////////
+    /// \brief lock-free stack of the free objects of one size class.
+    ///        the head packs the pointer in its low bits and a version tag
+    ///        in the high bits; every update bumps the tag, so a CAS based
+    ///        on a stale head fails even if the same pointer came back (ABA).
+    ///        each head owns a whole cache line.
+    ////////////////////////////////////////////////////////////////////////
+    struct alignas(64) FreeList {
+        enum {
+            PTR_BITS = sizeof(void*) == 8 ? 48 : 32
+        };
+
+        std::atomic<uint64_t> head;
+        std::atomic<uint64_t> retries;      ///< failed CAS, only touched on contention
+
+        static obj* pointer(uint64_t h) {
+            return (obj*)(uintptr_t)(h & ((uint64_t(1) << PTR_BITS) - 1));
+        }
+
+        static uint64_t pack(obj* p, uint64_t prev) {
+            return (uint64_t)(uintptr_t)p | (((prev >> PTR_BITS) + 1) << PTR_BITS);
+        }
+
+        void push(obj* first, obj* last) {
+            uint64_t old = head.load(std::memory_order_relaxed);
+            for(;;) {
+                last->free_list_link = pointer(old);
+                if(head.compare_exchange_weak(old, pack(first, old),
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed))
+                    return;
+                retries.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        obj* pop() {
+            uint64_t old = head.load(std::memory_order_acquire);
+            for(;;) {
+                obj* result = pointer(old);
+                if(result == 0) return 0;
+                if(head.compare_exchange_weak(old, pack(result->free_list_link, old),
+                                              std::memory_order_acquire,
+                                              std::memory_order_acquire))
+                    return result;
+                retries.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        /// detaches up to count objects with one CAS, linked up and ended by last.
+        /// a link is only followed while the head still reads old: then no object
+        /// has left the list since, so the link read before is a list link
+        obj* pop_n(int &count, obj* &last) {
+            uint64_t old = head.load(std::memory_order_acquire);
+            for(;;) {
+                obj* first = pointer(old);
+                if(first == 0) {
+                    count = 0;
+                    return 0;
+                }
+
+                obj* p = first;
+                obj* next = p->free_list_link;
+                int n = 1;
+                for(; n < count && next != 0; ++n) {
+                    if(head.load(std::memory_order_acquire) != old) break;
+                    p = next;
+                    next = p->free_list_link;
+                }
+                if(head.compare_exchange_weak(old, pack(next, old),
+                                              std::memory_order_acquire,
+                                              std::memory_order_acquire)) {
+                    p->free_list_link = 0;
+                    last = p;
+                    count = n;
+                    return first;
+                }
+                retries.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        obj* popAll() {
+            uint64_t old = head.load(std::memory_order_acquire);
+            while(!head.compare_exchange_weak(old, pack(0, old),
+                                              std::memory_order_acquire,
+                                              std::memory_order_acquire));
+            return pointer(old);
+        }
+    };
+
+    ////////////////////////////////////////////////////////////////////////
+    /// \brief header at the start of every superblock. a superblock only
+    ///        holds objects of one size class, which are carved from it in
+    ///        address order. live counts the objects outside the shared free
+    ///        list, i.e. held by callers or by thread caches.
+    ////////////////////////////////////////////////////////////////////////
+    struct Superblock {
+        Superblock*       next;             ///< next superblock of the same class
+        char              *start_free;
+        char              *end_free;
+        int               idx;
+        int               node;             ///< the arena the superblock belongs to
+        int               carved;           ///< objects carved so far
+        int               scratch;          ///< free objects counted by trim()
+        std::atomic<int>  live;
+    };
+
+    enum {
+        SUPERBLOCK_HEADER = 64
+    };
+
+    static Superblock* SuperblockOf(void* p) {
+        return (Superblock*)((uintptr_t)p & ~((uintptr_t)PageHeap::SUPERBLOCK_SIZE - 1));
+    }
+
+    ////////////////////////////////////////////////////////////////////////
+    /// \brief the free lists and superblocks of one NUMA node. a thread
+    ///        takes objects from the arena of the node it runs on, and freed
+    ///        objects go back to the arena their superblock belongs to
+    ////////////////////////////////////////////////////////////////////////
+    struct NodeArena {
+        explicit NodeArena(int node, bool bind);
+
+        FreeList          free_list[NFREELISTS];
+        std::mutex        carveMutex[NFREELISTS];
+        Superblock*       current[NFREELISTS];  ///< superblock being carved for each class
+        Superblock*       spans[NFREELISTS];    ///< all superblocks of each class
+        PageHeap          pages;
+    };
+
+    static void AccountLive(obj* head, obj* tail, int delta);
+
+    NodeArena* arena(int node);
+    int   CurrentNode(unsigned seq);
+
+    char* chunk_alloc(NodeArena& a, int node, int idx, int &nobjs);
+    obj*  refill(NodeArena& a, int node, int idx, int &nobjs);
+
+    obj*  fetch(int node, int idx, int &nobjs);
+    size_t fetch_batch(int node, int idx, size_t count, void** out);
+    void  release(int idx, obj* head, obj* tail);
+    void  trim(NodeArena& a);
+
+private:
+    size_t            class_size[NFREELISTS];
+    int               batch_limit[NFREELISTS];
+    unsigned char     class_index[CLASS_ARRAY_SIZE];
+
+    std::atomic<NodeArena*> arenas[MAX_NODES];
+    std::atomic<int>  nodes;                ///< arenas threads are spread over
+    std::atomic<bool> bindNodes;            ///< bind superblocks to their node, off when simulated
+    std::mutex        arenaMutex;
+    std::atomic<uint64_t> remote_frees;     ///< objects freed to the arena of another node
+
+    int               id;                   ///< 0 for the default heap, -1 for a heap without thread caches
+    uint64_t          generation;           ///< tells a thread cache of a destroyed heap from one of its successor
+    int               node_num;             ///< batch of every class set last by setNodeNum, 0 adapts
+    std::atomic<int>  fixed_batch[NFREELISTS];  ///< batch of each class, 0 adapts
+    SpanSet*          large;                ///< large spans to free on destroy(), 0 for the default heap
+
+    std::mutex        registryMutex;
+    ThreadCache*      registry;             ///< the active thread caches of this heap, for stats()
+
+    /// counters of exited threads and of calls made without a thread cache
+    std::atomic<uint64_t> retired_allocs[NFREELISTS];
+    std::atomic<uint64_t> retired_frees[NFREELISTS];
+    std::atomic<uint64_t> retired_refills[NFREELISTS];
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief per-thread magazines in front of the shared free lists of AllocImpl.
+///        allocate/deallocate only touch the calling thread's lists; objects
+///        move to and from the shared lists in batches. each class sizes its
+///        batch by itself unless the heap fixes it: like TCP slow start the
+///        batch doubles on every refill or flush, up to REFILL_BYTES worth
+///        of objects, and halves while the class sits idle.
+///        a thread may free memory allocated by another thread, the object
+///        simply joins the freeing thread's magazine of that size class,
+///        unless it belongs to the arena of another NUMA node.
+////////////////////////////////////////////////////////////////////////////////
+class ThreadCache {
+public:
+    enum {
+        ACTIVE = 1,
+        DEAD = 2,
+        IDLE_SCAN = 64,
+        NODE_CHECK = 16                     ///< remote frees between two looks at the thread's node
+    };
+
+    static ThreadCache* current();
+    static ThreadCache* current(AllocImpl& heap);
+    static ThreadCache* attached(AllocImpl& heap);
+
+    void* allocate(AllocImpl& heap, int idx);
+    void  deallocate(AllocImpl& heap, void* p, int idx);
+    size_t allocate_batch(AllocImpl& heap, int idx, size_t count, void** out);
+    void  count_frees(int idx, size_t count) { bump(frees[idx], count); }
+    void  flushAll();
+    void  retire();
+
+    static void retireAll();
+    static void stats(AllocImpl& heap, AllocStats& st);
+
 private:
-    obj* volatile     free_list[NFREELISTS];
-    std::atomic_bool  free_listRD[NFREELISTS];
-
-    char              *start_free;
-    char              *end_free;
-    size_t            heap_size;
-    std::atomic_bool  poolRD;
-    std::atomic_bool  chunk_allocRD;
+    void  attach(AllocImpl& heap);
+    void  flush(AllocImpl& heap, int idx, int nobjs);
+    int   grow(AllocImpl& heap, int idx);
+    void  shrinkIdle(AllocImpl& heap);
+    void  followNode(AllocImpl& heap);
+
+    int   batchOf(AllocImpl& heap, int idx) {
+        int fixed = heap.FixedBatch(idx);
+        if(fixed > 0) return fixed;
+        int b = batch[idx].load(std::memory_order_relaxed);
+        return b ? b : AllocImpl::MIN_BATCH;
+    }
+
+    /// only the owning thread writes a counter, so no read-modify-write is needed
+    static void bump(std::atomic<uint64_t>& c, uint64_t n = 1) {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+public:
+    AllocImpl::obj*  free_list[AllocImpl::NFREELISTS];
+    int              length[AllocImpl::NFREELISTS];
+    int              state;
+    int              node;                  ///< arena the thread refills from, refreshed on refills and remote frees
+    unsigned         seq;                   ///< order in which the thread registered
+    AllocImpl*       heap;
+    uint64_t         generation;            ///< generation of the heap when the cache attached
+
+    ThreadCache      *prev, *next;          ///< all active caches of the heap, for stats()
+    std::atomic<uint64_t> allocs[AllocImpl::NFREELISTS];
+    std::atomic<uint64_t> frees[AllocImpl::NFREELISTS];
+    std::atomic<uint64_t> refills[AllocImpl::NFREELISTS];
+    std::atomic<int> batch[AllocImpl::NFREELISTS];  ///< adaptive batch of each class, 0 before the first refill
+    uint64_t         idle_mark[AllocImpl::NFREELISTS];  ///< allocs + frees at the last idle scan
+    unsigned         slow_paths;            ///< refills and flushes, an idle scan runs every IDLE_SCAN
+    unsigned         remote_seen;           ///< remote frees, the node is looked up every NODE_CHECK
+
+    static std::atomic<unsigned> threads;
+};
+
+std::atomic<unsigned> ThreadCache::threads(0);
+
+/// trivially constructible, so reaching it from the hot path costs no TLS guard
+static thread_local ThreadCache t_cache;
+
+/// caches of the pi::Heap instances, by heap id, mapped on first use
+static thread_local ThreadCache* t_heapCaches[AllocImpl::MAX_HEAPS];
+
+/// the live heaps by id, a thread cache may only touch its heap under g_heapsMutex
+static std::mutex  g_heapsMutex;
+static AllocImpl*  g_heaps[AllocImpl::MAX_HEAPS];
+static uint64_t    g_heapGeneration = 0;
+
+struct ThreadCacheReaper {
+    int touched;
+    ~ThreadCacheReaper() {
+        ThreadCache::retireAll();
+    }
 };
 
+static thread_local ThreadCacheReaper t_cacheReaper;
+
+inline ThreadCache* AllocImpl::cache()
+{
+    return id == 0 ? ThreadCache::current() : ThreadCache::current(*this);
+}
+
 
 ///////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////
+std::atomic<PageMap::Node*> PageMap::root[PageMap::LENGTH];
+std::mutex                  PageMap::mapMutex;
+
+/// set while the thread is in one of the try_ calls of Alloc, which report
+/// running out of memory by returning 0 rather than ending the process
+static thread_local bool t_oomFails = false;
+
+bool PageMap::set(const void *p, size_t bytes, uintptr_t value)
+{
+    std::unique_lock<std::mutex> lock(mapMutex);
+
+    uintptr_t first = (uintptr_t)p >> PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t)p + bytes - 1) >> PAGE_SHIFT;
+    for(uintptr_t key = first; key <= last; ++key) {
+        if(key >> (3 * BITS)) {
+            if(value == 0) continue;
+            if(t_oomFails) return false;
+            THROW_BAD_ALLOC
+        }
+
+        // a page never set has nothing to clear, so clearing maps no node
+        std::atomic<Node*>& nodeRef = root[key >> (2 * BITS)];
+        Node* node = nodeRef.load(std::memory_order_relaxed);
+        if(node == 0) {
+            if(value == 0) continue;
+            // fresh mappings are zero, i.e. every child starts out empty
+            while((node = (Node*)OsMap(sizeof(Node), 0)) == 0)
+                if(!AllocPrime::call_oom_handler(true)) return false;
+            nodeRef.store(node, std::memory_order_release);
+        }
+
+        std::atomic<Leaf*>& leafRef = node->child[(key >> BITS) & (LENGTH - 1)];
+        Leaf* leaf = leafRef.load(std::memory_order_relaxed);
+        if(leaf == 0) {
+            if(value == 0) continue;
+            while((leaf = (Leaf*)OsMap(sizeof(Leaf), 0)) == 0)
+                if(!AllocPrime::call_oom_handler(true)) return false;
+            leafRef.store(leaf, std::memory_order_release);
+        }
+
+        leaf->value[key & (LENGTH - 1)].store(value, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+
 void (*AllocPrime::malloc_oom_handler)() = 0;
 std::atomic_bool AllocPrime::malloc_oom_handlerRD(true);
 
+std::mutex              AllocPrime::cacheMutex;
+AllocPrime::CachedSpan* AllocPrime::bins[AllocPrime::NBINS];
+AllocPrime::CachedSpan* AllocPrime::oldest = 0;
+AllocPrime::CachedSpan* AllocPrime::newest = 0;
+size_t                  AllocPrime::cached_bytes = 0;
+std::atomic<size_t>     AllocPrime::large_bytes(0);
+
 void *AllocPrime::allocate(size_t n)
 {
-    void* result = malloc(n);
-    if(0 == result) result = oom_malloc(n);
+    size_t bytes = SpanBytes(n);
+    int bin = BinIndex(bytes);
+
+    {
+        std::unique_lock<std::mutex> lock(cacheMutex);
+        CachedSpan* s = bins[bin];
+        if(s != 0) {
+            unlink(s);
+            evict(g_largeCacheLimit, now() - g_largeCacheDecay);
+            large_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            return s;
+        }
+    }
+
+    void* result = map(bytes);
+    if(0 == result) result = oom_malloc(bytes);
+    if(0 == result) return 0;
 
+    if(!PageMap::set(result, 1, bytes | PageMap::LARGE)) {
+        OsUnmap(result, bytes);
+        return 0;
+    }
+    large_bytes.fetch_add(bytes, std::memory_order_relaxed);
     return result;
 }
 
-void *AllocPrime::reallocate(void *p, size_t new_sz)
+void *AllocPrime::reallocate(void *p, size_t old_sz, size_t new_sz)
 {
-    void* result = realloc(p, new_sz);
-    if(0 == result) oom_realloc(p, new_sz);
+    size_t old_bytes = SpanBytes(old_sz);
+    size_t new_bytes = SpanBytes(new_sz);
+    if(old_bytes == new_bytes) return p;
+
+    void* result = OsRemap(p, old_bytes, new_bytes);
+    if(0 == result) result = oom_realloc(p, old_bytes, new_bytes);
+    if(0 == result) return 0;
+
+    // the page of p has an entry already, only a moved span may need a new leaf.
+    // without one the span moves back, the caller keeps p
+    if(!PageMap::set(result, 1, new_bytes | PageMap::LARGE)) {
+        mremap(result, new_bytes, old_bytes, MREMAP_MAYMOVE | MREMAP_FIXED, p);
+        g_osCalls.fetch_add(1, std::memory_order_relaxed);
+        TrackOS(old_bytes, new_bytes);
+        return 0;
+    }
+    if(result != p) PageMap::set(p, 1, 0);
+    large_bytes.fetch_add(new_bytes - old_bytes, std::memory_order_relaxed);
 
     return result;
 }
 
-void AllocPrime::deallocate(void *p)
+void AllocPrime::deallocate(void *p, size_t n)
 {
-    free(p);
+    size_t bytes = SpanBytes(n);
+    large_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    if(bytes > g_largeCacheLimit) {
+        unmap(p, bytes);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    evict(g_largeCacheLimit - bytes, now() - g_largeCacheDecay);
+
+    CachedSpan* s = (CachedSpan*)p;
+    int bin = BinIndex(bytes);
+    s->bytes = bytes;
+    s->stamp = now();
+    s->bin_prev = 0;
+    s->bin_next = bins[bin];
+    if(bins[bin]) bins[bin]->bin_prev = s;
+    bins[bin] = s;
+
+    s->age_prev = newest;
+    s->age_next = 0;
+    if(newest) newest->age_next = s;
+    else       oldest = s;
+    newest = s;
+    cached_bytes += bytes;
+}
+
+/// gives a span straight back to the OS, passing by the cache of freed spans
+void AllocPrime::release(void *p, size_t n)
+{
+    size_t bytes = SpanBytes(n);
+    large_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    unmap(p, bytes);
+}
+
+size_t AllocPrime::PageSize()
+{
+    static size_t page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+size_t AllocPrime::SpanBytes(size_t n)
+{
+    size_t page_size = PageSize();
+    size_t pages = (n + page_size - 1) / page_size;
+    if(pages <= (size_t)SPAN_STEPS)
+        return (pages ? pages : 1) * page_size;
+
+    size_t base = 1;
+    while(base * 2 <= pages) base *= 2;
+    size_t step = base / SPAN_STEPS;
+    return (pages + step - 1) / step * step * page_size;
+}
+
+int AllocPrime::BinIndex(size_t bytes)
+{
+    size_t pages = bytes / PageSize();
+    if(pages <= (size_t)SPAN_STEPS)
+        return (int)pages - 1;
+
+    int lg = 0;
+    while((pages >> (lg + 1)) != 0) ++lg;
+    size_t step = ((size_t)1 << lg) / SPAN_STEPS;
+    return SPAN_STEPS + (lg - 3) * SPAN_STEPS + (int)((pages - ((size_t)1 << lg)) / step);
+}
+
+int64_t AllocPrime::now()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void *AllocPrime::map(size_t bytes)
+{
+    if(!g_largeHugePage || bytes < (size_t)HUGE_PAGE)
+        return OsMap(bytes, 0);
+
+    void* p = OsMap(bytes, HUGE_PAGE);
+#ifdef MADV_HUGEPAGE
+    if(p) madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+void AllocPrime::unmap(void *p, size_t bytes)
+{
+    PageMap::set(p, 1, 0);
+    OsUnmap(p, bytes);
+}
+
+void AllocPrime::unlink(CachedSpan *s)
+{
+    int bin = BinIndex(s->bytes);
+    if(s->bin_prev) s->bin_prev->bin_next = s->bin_next;
+    else            bins[bin] = s->bin_next;
+    if(s->bin_next) s->bin_next->bin_prev = s->bin_prev;
+
+    if(s->age_prev) s->age_prev->age_next = s->age_next;
+    else            oldest = s->age_next;
+    if(s->age_next) s->age_next->age_prev = s->age_prev;
+    else            newest = s->age_prev;
+
+    cached_bytes -= s->bytes;
+}
+
+size_t AllocPrime::evict(size_t limit, int64_t expire)
+{
+    size_t released = 0;
+    while(oldest != 0 && (cached_bytes > limit || oldest->stamp < expire)) {
+        CachedSpan* s = oldest;
+        size_t bytes = s->bytes;
+        unlink(s);
+        unmap(s, bytes);
+        released += bytes;
+    }
+    return released;
 }
 
 void (* AllocPrime::set_oom_malloc_handler(void (*f)())) ()
@@ -118,6 +985,32 @@ void (* AllocPrime::set_oom_malloc_handler(void (*f)())) ()
     return old;
 }
 
+/// false when the caller may fail and should: no handler is set and the
+/// thread is in a try_ call
+bool AllocPrime::call_oom_handler(bool may_fail)
+{
+    void (*my_malloc_handler)() = malloc_oom_handler;
+    if(0 == my_malloc_handler) {
+        if(may_fail && t_oomFails) return false;
+        THROW_BAD_ALLOC
+    }
+    (*my_malloc_handler)();
+    return true;
+}
+
+size_t AllocPrime::trim(size_t limit)
+{
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    return evict(limit, now() - g_largeCacheDecay);
+}
+
+void AllocPrime::stats(AllocStats &st)
+{
+    std::unique_lock<std::mutex> lock(cacheMutex);
+    st.large_bytes = large_bytes.load(std::memory_order_relaxed);
+    st.large_cached_bytes = cached_bytes;
+}
+
 void *AllocPrime::oom_malloc(size_t n)
 {
     void (*my_malloc_handler)() = 0;
@@ -125,25 +1018,31 @@ void *AllocPrime::oom_malloc(size_t n)
 
     while(true) {
         my_malloc_handler = malloc_oom_handler;
-        if(0 == my_malloc_handler) {THROW_BAD_ALLOC}
+        if(0 == my_malloc_handler) {
+            if(t_oomFails) return 0;
+            THROW_BAD_ALLOC
+        }
         (*my_malloc_handler)();
 
-        result = malloc(n);
+        result = map(n);
         if(result) return result;
     }
 }
 
-void *AllocPrime::oom_realloc(void *p, size_t n)
+void *AllocPrime::oom_realloc(void *p, size_t old_sz, size_t n)
 {
     void (*my_malloc_handler)() = 0;
     void *result = 0;
 
     while(true) {
         my_malloc_handler = malloc_oom_handler;
-        if(0 == my_malloc_handler) {THROW_BAD_ALLOC}
+        if(0 == my_malloc_handler) {
+            if(t_oomFails) return 0;
+            THROW_BAD_ALLOC
+        }
         (*my_malloc_handler)();
 
-        result = realloc(p, n);
+        result = OsRemap(p, old_sz, n);
         if(result) return result;
     }
 }
@@ -152,208 +1051,2386 @@ void *AllocPrime::oom_realloc(void *p, size_t n)
 ///////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////
 
-AllocImpl& AllocImpl::Instance() {
-    static AllocImpl theOneAndOnly;
-    return theOneAndOnly;
+PageHeap::PageHeap(int node)
+    : resident(0), resident_bytes(0), returned(0),
+      extent_free(0), extent_end(0), heap_size(0), node(node),
+      extents(0), nextents(0), extents_cap(0)
+{
 }
 
-void *AllocImpl::allocate(size_t n)
+char *PageHeap::obtain()
 {
-    if(n > (size_t) MAX_BYTES) {
-        return AllocPrime::allocate(n);
-    }
-
-    int idx = FreeListIndex(n);
-    while(free_listRD[idx] == false) std::this_thread::yield();
-    free_listRD[idx] = false;
-    obj* volatile *my_free_list = free_list + idx;
-
-REFILL:
-    obj* result = *my_free_list;
+    std::unique_lock<std::mutex> lock(heapMutex);
 
-    if(result == 0) {
-        void *r = refill(ROUND_UP(n));
-        if(r == 0) {
-            usleep(1);
-            goto REFILL;
-        }
-        free_listRD[idx] = true;
-        return r;
+    if(resident != 0) {
+        FreeBlock* b = resident;
+        resident = b->next;
+        resident_bytes -= SUPERBLOCK_SIZE;
+        return (char*)b;
     }
 
-    *my_free_list = result->free_list_link;
-    free_listRD[idx] = true;
-    return result;
+    return take_cold();
 }
 
-void AllocImpl::deallocate(void *p, size_t n)
+/// a superblock whose pages are not backed yet: a returned one or the next of the extent
+char *PageHeap::take_cold()
 {
-    if(n > (size_t)MAX_BYTES) {
-        AllocPrime::deallocate(p);
-        return;
+    if(returned != 0) {
+        FreeBlock* b = returned;
+        returned = b->next;
+        OsRecommit(SUPERBLOCK_SIZE);
+        return (char*)b;
     }
 
-    obj *q = (obj*)p;
-    int idx = FreeListIndex(n);
-    while(free_listRD[idx] == false) std::this_thread::yield();
-    free_listRD[idx] = false;
-    obj* volatile *my_free_list = free_list + idx;
+    if(extent_free == extent_end && map_extent() == 0)
+        return 0;
 
-    q->free_list_link = *my_free_list;
-    *my_free_list = q;
-    free_listRD[idx] = true;
+    char* result = extent_free;
+    extent_free += SUPERBLOCK_SIZE;
+    return result;
 }
 
+void PageHeap::release(char *sb)
+{
+    std::unique_lock<std::mutex> lock(heapMutex);
+
+    FreeBlock* b = (FreeBlock*)sb;
+    b->next = resident;
+    resident = b;
+    resident_bytes += SUPERBLOCK_SIZE;
+}
+
+size_t PageHeap::scavenge(size_t keep_bytes)
+{
+    std::unique_lock<std::mutex> lock(heapMutex);
+    size_t released = 0;
+
+    while(resident != 0 && resident_bytes > keep_bytes) {
+        FreeBlock* b = resident;
+        resident = b->next;
+        resident_bytes -= SUPERBLOCK_SIZE;
+
+        OsDecommit(b, SUPERBLOCK_SIZE);
+        b->next = returned;
+        returned = b;
+        released += SUPERBLOCK_SIZE;
+    }
+
+    return released;
+}
+
+/// once the resident superblocks fell below low_bytes, adds prefaulted ones until
+/// there are high_bytes. the faults are taken outside the lock, so threads taking
+/// superblocks meanwhile never wait for them
+size_t PageHeap::provision(size_t low_bytes, size_t high_bytes)
+{
+    size_t added = 0;
+    while(added < high_bytes) {
+        char* sb;
+        {
+            std::unique_lock<std::mutex> lock(heapMutex);
+            if(resident_bytes >= (added ? high_bytes : low_bytes)) break;
+            if((sb = take_cold()) == 0) break;
+        }
+        OsPrefault(sb, SUPERBLOCK_SIZE);
+        release(sb);
+        added += SUPERBLOCK_SIZE;
+    }
+    return added;
+}
+
+size_t PageHeap::mapped()
+{
+    std::unique_lock<std::mutex> lock(heapMutex);
+    return heap_size;
+}
+
+/// gives every extent back to the OS, the superblocks must not be used any more
+void PageHeap::unmapAll()
+{
+    std::unique_lock<std::mutex> lock(heapMutex);
+    size_t bytes = (size_t)SUPERBLOCK_SIZE * EXTENT_BLOCKS;
+
+    // returned superblocks were already taken off the books by OsDecommit
+    for(FreeBlock* b = returned; b != 0; b = b->next)
+        TrackOS(SUPERBLOCK_SIZE, 0);
+    for(size_t i = 0; i < nextents; ++i) {
+        PageMap::set(extents[i], bytes, 0);
+        OsUnmap(extents[i], bytes);
+    }
+    if(extents != 0) OsUnmap(extents, extents_cap * sizeof(char*));
+
+    extents = 0;
+    nextents = extents_cap = 0;
+    resident = returned = 0;
+    resident_bytes = heap_size = 0;
+    extent_free = extent_end = 0;
+}
+
+char *PageHeap::map_extent()
+{
+    size_t bytes = (size_t)SUPERBLOCK_SIZE * EXTENT_BLOCKS;
+    if(nextents == extents_cap) {
+        size_t cap = extents_cap ? extents_cap * 2 : AllocPrime::PageSize() / sizeof(char*);
+        char** grown = (char**)OsMap(cap * sizeof(char*), 0);
+        if(grown == 0) return 0;
+        if(extents != 0) {
+            memcpy(grown, extents, nextents * sizeof(char*));
+            OsUnmap(extents, extents_cap * sizeof(char*));
+        }
+        extents = grown;
+        extents_cap = cap;
+    }
+
+    char* p = (char*)OsMap(bytes, SUPERBLOCK_SIZE);
+    if(p == 0) return 0;
+    if(node >= 0) OsBind(p, bytes, node);
+    extents[nextents++] = p;
+
+    extent_free = p;
+    extent_end = p + bytes;
+    heap_size += bytes;
+    return p;
+}
+
+///////////////////////////////////////////////////////
+///////////////////////////////////////////////////////
+///////////////////////////////////////////////////////
+
+/// a table that cannot grow still takes a span while it has a free slot, so one
+/// erased just before always makes room
+bool SpanSet::insert(void *p)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if((used + 1) * 4 > cap * 3)
+        if(!rehash(count * 2 > cap / 2 ? cap * 2 : cap ? cap : 512) && count == cap)
+            return false;
+
+    size_t i = home((uintptr_t)p);
+    while(slots[i] > TOMBSTONE) i = (i + 1) & (cap - 1);
+    if(slots[i] == 0) ++used;
+    slots[i] = (uintptr_t)p;
+    ++count;
+    return true;
+}
+
+void SpanSet::erase(void *p)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(cap == 0) return;
+
+    for(size_t i = home((uintptr_t)p); slots[i] != 0; i = (i + 1) & (cap - 1))
+        if(slots[i] == (uintptr_t)p) {
+            slots[i] = TOMBSTONE;
+            --count;
+            return;
+        }
+}
+
+template <typename F>
+void SpanSet::drain(F f)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for(size_t i = 0; i < cap; ++i)
+        if(slots[i] > TOMBSTONE) f((void*)slots[i]);
+
+    if(slots != 0) OsUnmap(slots, cap * sizeof(uintptr_t));
+    slots = 0;
+    cap = count = used = 0;
+}
+
+size_t SpanSet::bytes()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    size_t total = 0;
+    for(size_t i = 0; i < cap; ++i)
+        if(slots[i] > TOMBSTONE) total += PageMap::get((void*)slots[i]) & ~(uintptr_t)3;
+    return total;
+}
+
+/// moves the spans to a table of new_cap slots, tombstones are dropped on the way.
+/// false keeps the old table
+bool SpanSet::rehash(size_t new_cap)
+{
+    uintptr_t* old = slots;
+    size_t old_cap = cap;
+
+    uintptr_t* grown;
+    while((grown = (uintptr_t*)OsMap(new_cap * sizeof(uintptr_t), 0)) == 0)
+        if(!AllocPrime::call_oom_handler(true)) return false;
+    slots = grown;
+    cap = new_cap;
+    used = count;
+
+    for(size_t j = 0; j < old_cap; ++j) {
+        if(old[j] <= TOMBSTONE) continue;
+        size_t i = home(old[j]);
+        while(slots[i] != 0) i = (i + 1) & (cap - 1);
+        slots[i] = old[j];
+    }
+    if(old != 0) OsUnmap(old, old_cap * sizeof(uintptr_t));
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// the provisioning thread sleeps until a refill took a superblock, then tops up
+/// the arenas of the default heap which fell below the low watermark. it starts
+/// with the first setProvisioning that turns provisioning on and stays, with
+/// provisioning off it only sleeps
+////////////////////////////////////////////////////////////////////////////////
+
+/// never destroyed, a detached provisioner may still wait on it during exit
+struct ProvisionerState {
+    std::mutex              mutex;
+    std::condition_variable wake;
+    bool                    started;        ///< the thread runs, not after a fork
+    bool                    requested;
+};
+
+/// set on first use, for the fork handlers, which must not allocate
+static std::atomic<ProvisionerState*> g_provisioner(0);
+
+static ProvisionerState& provisionerState()
+{
+    static ProvisionerState* state = new ProvisionerState();
+    g_provisioner.store(state, std::memory_order_release);
+    return *state;
+}
+
+static void RequestProvision()
+{
+    ProvisionerState& st = provisionerState();
+    std::unique_lock<std::mutex> lock(st.mutex);
+    st.requested = true;
+    st.wake.notify_one();
+}
+
+static void ForkPrepare();
+static void ForkParent();
+static void ForkChild();
+
+/// the default heap, which makes fork() wait until it holds every lock of the allocator
+struct DefaultHeap : public AllocImpl {
+    DefaultHeap() : AllocImpl(0, -1) {
+        pthread_atfork(ForkPrepare, ForkParent, ForkChild);
+    }
+};
+
+AllocImpl& AllocImpl::Instance() {
+    static DefaultHeap theOneAndOnly;
+    return theOneAndOnly;
+}
+
+void *AllocImpl::allocate(size_t n)
+{
+    if(n > (size_t) MAX_BYTES) {
+        return allocate_large(n);
+    }
+
+    int idx = FreeListIndex(n);
+    ThreadCache* cache = this->cache();
+    if(cache) return cache->allocate(*this, idx);
+
+    int nobjs = 1;
+    retired_allocs[idx].fetch_add(1, std::memory_order_relaxed);
+    return fetch(CurrentNode(0), idx, nobjs);
+}
+
+void AllocImpl::deallocate(void *p, size_t n)
+{
+    if(n > (size_t)MAX_BYTES) {
+        deallocate_large(p, n);
+        return;
+    }
+
+    int idx = FreeListIndex(n);
+    ThreadCache* cache = this->cache();
+    if(cache) {
+        cache->deallocate(*this, p, idx);
+        return;
+    }
+
+    obj *q = (obj*)p;
+    retired_frees[idx].fetch_add(1, std::memory_order_relaxed);
+    q->free_list_link = 0;
+    release(idx, q, q);
+}
+
+/// objects are carved from a 64 bytes aligned start, so an object of a class sized a
+/// multiple of the alignment is aligned. rounding n up to a multiple of alignment always
+/// lands on such a class, larger alignments take a page aligned span
+void *AllocImpl::allocate_aligned(size_t n, size_t alignment)
+{
+    if(alignment & (alignment - 1) || alignment > AllocPrime::PageSize())
+        return 0;
+    if(alignment <= (size_t)ALIGN)
+        return allocate(n);
+
+    size_t rounded = (n + alignment - 1) & ~(alignment - 1);
+    if(alignment <= (size_t)NATURAL_ALIGN || rounded > (size_t)MAX_BYTES)
+        return allocate(rounded);
+    return allocate_large(n);
+}
+
+void AllocImpl::deallocate_aligned(void *p, size_t n, size_t alignment)
+{
+    if(alignment <= (size_t)ALIGN) {
+        deallocate(p, n);
+        return;
+    }
+
+    size_t rounded = (n + alignment - 1) & ~(alignment - 1);
+    if(alignment <= (size_t)NATURAL_ALIGN || rounded > (size_t)MAX_BYTES)
+        deallocate(p, rounded);
+    else
+        deallocate_large(p, n);
+}
+
+void AllocImpl::deallocate(void *p)
+{
+    uintptr_t entry = PageMap::get(p);
+
+    if(entry & PageMap::SMALL)
+        deallocate(p, class_size[entry >> 2]);
+    else if(entry & PageMap::LARGE)
+        deallocate_large(p, entry & ~(uintptr_t)3);
+}
+
+size_t AllocImpl::usable_size(void *p)
+{
+    uintptr_t entry = PageMap::get(p);
+
+    if(entry & PageMap::SMALL)
+        return class_size[entry >> 2];
+    if(entry & PageMap::LARGE)
+        return entry & ~(uintptr_t)3;
+    return 0;
+}
+
+size_t AllocImpl::allocate_batch(size_t n, size_t count, void **out)
+{
+    if(n > (size_t)MAX_BYTES) {
+        for(size_t i = 0; i < count; ++i)
+            if((out[i] = allocate_large(n)) == 0) return i;
+        return count;
+    }
+
+    int idx = FreeListIndex(n);
+    ThreadCache* cache = this->cache();
+    if(cache) return cache->allocate_batch(*this, idx, count, out);
+
+    size_t got = fetch_batch(CurrentNode(0), idx, count, out);
+    retired_allocs[idx].fetch_add(got, std::memory_order_relaxed);
+    return got;
+}
+
+/// the objects are linked up and spliced into the shared list at once,
+/// they skip the thread cache which a batch would only overflow
+void AllocImpl::deallocate_batch(void **ptrs, size_t count, size_t n)
+{
+    if(count == 0) return;
+    if(n > (size_t)MAX_BYTES) {
+        for(size_t i = 0; i < count; ++i)
+            deallocate_large(ptrs[i], n);
+        return;
+    }
+
+    int idx = FreeListIndex(n);
+    ThreadCache* cache = this->cache();
+    if(cache) cache->count_frees(idx, count);
+    else retired_frees[idx].fetch_add(count, std::memory_order_relaxed);
+
+    for(size_t i = 0; i + 1 < count; ++i)
+        ((obj*)ptrs[i])->free_list_link = (obj*)ptrs[i + 1];
+    ((obj*)ptrs[count - 1])->free_list_link = 0;
+    release(idx, (obj*)ptrs[0], (obj*)ptrs[count - 1]);
+}
+
+/// keeps the contents: a size of the same class keeps the block, a large span is
+/// resized by mremap (in place when the pages behind it are free), anything else
+/// moves min(old_sz, new_sz) bytes to a new block
 void *AllocImpl::reallocate(void *p, size_t old_sz, size_t new_sz)
 {
+    if(p == 0)
+        return allocate(new_sz);
+
+    if(old_sz > (size_t)MAX_BYTES && new_sz > (size_t)MAX_BYTES) {
+        if(large == 0)
+            return AllocPrime::reallocate(p, old_sz, new_sz);
+        large->erase(p);
+        void* result = AllocPrime::reallocate(p, old_sz, new_sz);
+        large->insert(result ? result : p);
+        return result;
+    }
+
+    if(old_sz <= (size_t)MAX_BYTES && new_sz <= (size_t)MAX_BYTES &&
+       FreeListIndex(old_sz) == FreeListIndex(new_sz))
+        return p;
+
+    void* result = allocate(new_sz);
+    if(result == 0) return 0;
+    memcpy(result, p, std::min(old_sz, new_sz));
     deallocate(p, old_sz);
-    p = allocate(new_sz);
+    return result;
+}
+
+void *AllocImpl::allocate_large(size_t n)
+{
+    void* p = AllocPrime::allocate(n);
+    if(p != 0 && large != 0 && !large->insert(p)) {
+        AllocPrime::release(p, n);
+        return 0;
+    }
     return p;
 }
 
-AllocImpl::AllocImpl()
+void AllocImpl::deallocate_large(void *p, size_t n)
 {
+    if(large != 0) large->erase(p);
+    AllocPrime::deallocate(p, n);
+}
+
+AllocImpl::AllocImpl(int node_num, int init_pool_size)
+    : id(0), generation(0), node_num(node_num), large(0), registry(0)
+{
+    int nclass = 0;
+    for(size_t sz = ALIGN; sz <= (size_t)MAX_LINEAR_BYTES; sz += ALIGN)
+        class_size[nclass++] = sz;
+    for(size_t base = MAX_LINEAR_BYTES; base < (size_t)MAX_BYTES; base *= 2) {
+        for(int k = 1; k <= CLASS_STEPS; ++k)
+            class_size[nclass++] = base + k * (base / CLASS_STEPS);
+    }
+
     for(int i = 0; i < NFREELISTS; ++i) {
-        free_list[i] = 0;
-        free_listRD[i] = true;
+        int limit = (int)(REFILL_BYTES / class_size[i]);
+        batch_limit[i] = std::max((int)MIN_BATCH, std::min((int)MAX_BATCH, limit));
+        fixed_batch[i] = node_num > 0 ? node_num : 0;
     }
 
-    heap_size = g_InitPoolSize;
-    start_free = (char*)malloc(heap_size);
-    end_free = heap_size + start_free;
+    for(size_t i = 0, next = 0; i < NFREELISTS; ++i) {
+        size_t last = ClassArrayIndex(class_size[i]);
+        while(next <= last)
+            class_index[next++] = (unsigned char)i;
+    }
 
-    poolRD = true;
-    chunk_allocRD = true;
+    for(int i = 0; i < NFREELISTS; ++i) {
+        retired_allocs[i] = 0;
+        retired_frees[i] = 0;
+        retired_refills[i] = 0;
+    }
+    remote_frees = 0;
+
+    for(int i = 0; i < MAX_NODES; ++i)
+        arenas[i] = 0;
+    nodes = 1;
+    setNodes(g_numaSimulated);
+
+    // pre-map the initial pool so the first refills do not each hit the OS
+    NodeArena* a = arena(0);
+    if(init_pool_size < 0) init_pool_size = g_InitPoolSize;
+    for(int ps = 0; a != 0 && ps < init_pool_size; ps += PageHeap::SUPERBLOCK_SIZE) {
+        char* sb = a->pages.obtain();
+        if(sb) a->pages.release(sb);
+    }
 }
 
+/// makes this a pi::Heap: an id for its thread caches and a record of its large spans
+void AllocImpl::enroll()
+{
+    void* mem;
+    while((mem = OsMap(sizeof(SpanSet), 0)) == 0)
+        AllocPrime::call_oom_handler();
+    large = new(mem) SpanSet();
+
+    std::unique_lock<std::mutex> lock(g_heapsMutex);
+    generation = ++g_heapGeneration;
+    id = -1;
+    for(int i = 1; i < MAX_HEAPS; ++i)
+        if(g_heaps[i] == 0) {
+            g_heaps[i] = this;
+            id = i;
+            break;
+        }
+}
 
-void* AllocImpl::refill(size_t n)
+/// gives everything the heap holds back to the OS at once, outstanding blocks die with it.
+/// thread caches still attached notice the new generation and start over
+void AllocImpl::destroy()
 {
-    int nobjs = g_defaultNodeNum;
-    char *chunck = chunk_alloc(n, nobjs);
-    if(chunck == 0) return 0;
-    obj* volatile *my_free_list = 0;
-    obj* result = 0;
-    obj *current_obj(0), *next_obj(0);
+    {
+        std::unique_lock<std::mutex> lock(g_heapsMutex);
+        if(id > 0) g_heaps[id] = 0;
+    }
+
+    // the spans of a destroyed heap go back to the OS, not to the shared span cache
+    large->drain([](void* p) {
+        AllocPrime::release(p, PageMap::get(p) & ~(uintptr_t)3);
+    });
+    large->~SpanSet();
+    OsUnmap(large, sizeof(SpanSet));
+    large = 0;
+
+    for(int node = 0; node < MAX_NODES; ++node) {
+        NodeArena* a = arenas[node].load(std::memory_order_acquire);
+        if(a == 0) continue;
+        a->pages.unmapAll();
+        a->~NodeArena();
+        OsUnmap(a, sizeof(NodeArena));
+        arenas[node] = 0;
+    }
+}
 
-    if(1 == nobjs) return chunck;
+size_t AllocImpl::provision(size_t low_bytes, size_t high_bytes)
+{
+    size_t added = 0;
+    for(int node = 0; node < MAX_NODES; ++node) {
+        NodeArena* a = arenas[node].load(std::memory_order_acquire);
+        if(a != 0) added += a->pages.provision(low_bytes, high_bytes);
+    }
+    return added;
+}
 
-    int idx = FreeListIndex(n);
+int AllocImpl::arenaCount()
+{
+    int n = 0;
+    for(int node = 0; node < MAX_NODES; ++node)
+        if(arenas[node].load(std::memory_order_acquire) != 0) ++n;
+    return n;
+}
 
-    my_free_list = free_list + idx;
-    result = (obj*)chunck;
+/// bytes 0 sets every class, others only the class of bytes
+int AllocImpl::setNodeNum(int nn, size_t bytes)
+{
+    if(nn < 0) nn = 0;
+    if(bytes > (size_t)MAX_BYTES) return 0;
+    if(bytes != 0) {
+        int idx = FreeListIndex(bytes);
+        return fixed_batch[idx].exchange(nn, std::memory_order_relaxed);
+    }
 
-    *my_free_list = next_obj = (obj*)(chunck + n);
+    int nn_old = node_num;
+    node_num = nn;
+    for(int i = 0; i < NFREELISTS; ++i)
+        fixed_batch[i].store(nn, std::memory_order_relaxed);
+    return nn_old;
+}
 
-    for(int i = 1;; ++i) {
-        current_obj = next_obj;
-        next_obj = (obj*)((char*)next_obj + n);
-        if(nobjs - 1 == i) {
-            current_obj->free_list_link = 0;
-            break;
+AllocImpl::NodeArena::NodeArena(int node, bool bind)
+    : pages(bind ? node : -1)
+{
+    for(int i = 0; i < NFREELISTS; ++i) {
+        free_list[i].head = 0;
+        free_list[i].retries = 0;
+        current[i] = 0;
+        spans[i] = 0;
+    }
+}
+
+/// arenas are created on first use and never destroyed, superblocks keep pointing at them.
+/// 0 when there is no memory for a new one and the caller may fail
+AllocImpl::NodeArena* AllocImpl::arena(int node)
+{
+    NodeArena* a = arenas[node].load(std::memory_order_acquire);
+    if(a != 0) return a;
+
+    std::unique_lock<std::mutex> lock(arenaMutex);
+    a = arenas[node].load(std::memory_order_relaxed);
+    if(a == 0) {
+        void* mem;
+        while((mem = OsMap(sizeof(NodeArena), 0)) == 0)
+            if(!AllocPrime::call_oom_handler(true)) return 0;
+        a = new(mem) NodeArena(node, bindNodes);
+        arenas[node].store(a, std::memory_order_release);
+    }
+    return a;
+}
+
+/// the node of the calling thread, a simulated topology spreads threads by their sequence number
+int AllocImpl::CurrentNode(unsigned seq)
+{
+    int n = nodes.load(std::memory_order_relaxed);
+    if(n == 1) return 0;
+    if(!bindNodes) return (int)(seq % n);
+    int node = OsCurrentNode();
+    return node < n ? node : node % n;
+}
+
+int AllocImpl::setNodes(int simulated)
+{
+    int nodes_old = nodes;
+    std::unique_lock<std::mutex> lock(arenaMutex);
+    bindNodes = simulated <= 0;
+    int n = simulated > 0 ? simulated : OsNodes();
+    nodes = n < 1 ? 1 : n > MAX_NODES ? MAX_NODES : n;
+    return nodes_old;
+}
+
+
+AllocImpl::obj* AllocImpl::fetch(int node, int idx, int &nobjs)
+{
+    NodeArena* arena = this->arena(node);
+    if(arena == 0) return 0;
+    NodeArena& a = *arena;
+    FreeList& my_free_list = a.free_list[idx];
+    obj* result = my_free_list.pop();
+
+    if(result != 0) {
+        obj* last = result;
+        int i = 1;
+        for(; i < nobjs; ++i) {
+            obj* next = my_free_list.pop();
+            if(next == 0) break;
+            last->free_list_link = next;
+            last = next;
         }
-        else {
-            current_obj->free_list_link = next_obj;
+
+        last->free_list_link = 0;
+        nobjs = i;
+        AccountLive(result, last, 1);
+        return result;
+    }
+
+    return refill(a, node, idx, nobjs);
+}
+
+/// detaches the run the batch needs off the shared list with one CAS, so the cost
+/// does not grow with the list and other threads never find it emptied meanwhile;
+/// the remainder is carved straight from superblocks
+size_t AllocImpl::fetch_batch(int node, int idx, size_t count, void **out)
+{
+    NodeArena* arena = this->arena(node);
+    if(arena == 0) return 0;
+    NodeArena& a = *arena;
+    size_t got = 0;
+
+    obj* last = 0;
+    int nobjs = (int)std::min(count, (size_t)std::numeric_limits<int>::max());
+    obj* list = count ? a.free_list[idx].pop_n(nobjs, last) : 0;
+    if(list != 0) {
+        AccountLive(list, last, 1);
+        for(obj* p = list; got < (size_t)nobjs; p = p->free_list_link)
+            out[got++] = p;
+    }
+
+    while(got < count) {
+        int nobjs = (int)std::min(count - got, (size_t)std::numeric_limits<int>::max());
+        char* p = chunk_alloc(a, node, idx, nobjs);
+        if(p == 0) break;
+        for(int i = 0; i < nobjs; ++i, p += class_size[idx])
+            out[got++] = p;
+    }
+    return got;
+}
+
+void AllocImpl::release(int idx, obj *head, obj *tail)
+{
+    AccountLive(head, tail, -1);
+    if(nodes.load(std::memory_order_relaxed) == 1 && SuperblockOf(head)->node == 0) {
+        arenas[0].load(std::memory_order_relaxed)->free_list[idx].push(head, tail);
+        return;
+    }
+
+    // every object goes back to the arena of its superblock, a batch is split
+    // into runs of one node
+    obj* run = head;
+    int node = SuperblockOf(head)->node;
+    for(obj* p = head;;) {
+        obj* next = p == tail ? 0 : p->free_list_link;
+        if(next == 0 || SuperblockOf(next)->node != node) {
+            arenas[node].load(std::memory_order_relaxed)->free_list[idx].push(run, p);
+            if(next == 0) break;
+            run = next;
+            node = SuperblockOf(next)->node;
         }
+        p = next;
     }
+}
 
-    return result;
+void AllocImpl::AccountLive(obj *head, obj *tail, int delta)
+{
+    // neighbouring objects mostly share a superblock, so count runs
+    Superblock* sb = SuperblockOf(head);
+    int run = 0;
+    for(obj* p = head;; p = p->free_list_link) {
+        Superblock* s = SuperblockOf(p);
+        if(s != sb) {
+            sb->live.fetch_add(run * delta, std::memory_order_relaxed);
+            sb = s;
+            run = 0;
+        }
+        ++run;
+        if(p == tail) break;
+    }
+    sb->live.fetch_add(run * delta, std::memory_order_relaxed);
 }
 
 
-char* AllocImpl::chunk_alloc(size_t size, int &nobjs)
+AllocImpl::obj* AllocImpl::refill(NodeArena& a, int node, int idx, int &nobjs)
 {
-    char *result = 0;
-    size_t total_bytes = size * nobjs;
-    while(poolRD == false) std::this_thread::yield();
-    poolRD = false;
-    size_t bytes_left = end_free - start_free;
-    if(bytes_left > total_bytes) {
-        result = start_free;
-        start_free += total_bytes;
-        poolRD = true;
-        return result;
+    size_t n = class_size[idx];
+    char *chunck = chunk_alloc(a, node, idx, nobjs);
+    if(chunck == 0) return 0;
+    obj* result = (obj*)chunck;
+    obj *current_obj(result), *next_obj(0);
+
+    for(int i = 1; i < nobjs; ++i) {
+        next_obj = (obj*)((char*)current_obj + n);
+        current_obj->free_list_link = next_obj;
+        current_obj = next_obj;
     }
+    current_obj->free_list_link = 0;
 
-    else if(bytes_left >= size) {
-        nobjs = bytes_left / size;
-        total_bytes = size * nobjs;
-        result = start_free;
-        start_free += total_bytes;
-        poolRD = true;
-        return result;
+    return result;
+}
+
+
+char* AllocImpl::chunk_alloc(NodeArena& a, int node, int idx, int &nobjs)
+{
+    size_t size = class_size[idx];
+    std::unique_lock<std::mutex> lock(a.carveMutex[idx], std::try_to_lock);
+    if(!lock.owns_lock()) {
+        a.free_list[idx].retries.fetch_add(1, std::memory_order_relaxed);
+        lock.lock();
     }
 
-    else {
-        if(chunk_allocRD == false) {
-            poolRD = true;
+    Superblock* sb = a.current[idx];
+    if(sb == 0 || (size_t)(sb->end_free - sb->start_free) < size) {
+        char* mem;
+        while((mem = a.pages.obtain()) == 0)
+            if(!AllocPrime::call_oom_handler(true)) return 0;
+        if(!PageMap::set(mem, PageHeap::SUPERBLOCK_SIZE, ((uintptr_t)idx << 2) | PageMap::SMALL)) {
+            a.pages.release(mem);
             return 0;
         }
-        chunk_allocRD = false;
 
-        size_t bytes_to_get = 2 * total_bytes + ROUND_UP(heap_size >> 4);
-        if(bytes_left > 0) {
-            obj* volatile *my_free_list = free_list + FreeListIndex(bytes_left);
-            ((obj*)start_free)->free_list_link = *my_free_list;
-            *my_free_list = (obj*)start_free;
+        sb = (Superblock*)mem;
+        sb->next = a.spans[idx];
+        sb->start_free = mem + SUPERBLOCK_HEADER;
+        sb->end_free = mem + PageHeap::SUPERBLOCK_SIZE;
+        sb->idx = idx;
+        sb->node = node;
+        sb->carved = 0;
+        sb->scratch = 0;
+        sb->live = 0;
+        a.spans[idx] = sb;
+        a.current[idx] = sb;
+
+        if(id == 0 && g_provisionLow.load(std::memory_order_relaxed) != 0)
+            RequestProvision();
+    }
+
+    size_t bytes_left = sb->end_free - sb->start_free;
+    if(bytes_left < size * nobjs)
+        nobjs = bytes_left / size;
+
+    char* result = sb->start_free;
+    sb->start_free += size * nobjs;
+    sb->carved += nobjs;
+    sb->live.fetch_add(nobjs, std::memory_order_relaxed);
+    return result;
+}
+
+/// releases the superblocks of an arena whose objects are all free
+void AllocImpl::trim(NodeArena& a)
+{
+    for(int idx = 0; idx < NFREELISTS; ++idx) {
+        std::unique_lock<std::mutex> lock(a.carveMutex[idx]);
+
+        bool idle = false;
+        for(Superblock* sb = a.spans[idx]; sb != 0; sb = sb->next)
+            if(sb->live.load(std::memory_order_relaxed) == 0) idle = true;
+        if(!idle) continue;
+
+        // every object in hand is free, a superblock is releasable once all
+        // of its carved objects are in hand
+        obj* list = a.free_list[idx].popAll();
+        for(Superblock* sb = a.spans[idx]; sb != 0; sb = sb->next)
+            sb->scratch = 0;
+        for(obj* p = list; p != 0; p = p->free_list_link)
+            SuperblockOf(p)->scratch++;
+        for(Superblock* sb = a.spans[idx]; sb != 0; sb = sb->next)
+            if(sb->scratch == sb->carved) sb->scratch = -1;
+
+        obj *head = 0, *tail = 0;
+        for(obj* p = list; p != 0;) {
+            obj* next = p->free_list_link;
+            if(SuperblockOf(p)->scratch >= 0) {
+                if(tail) tail->free_list_link = p;
+                else     head = p;
+                tail = p;
+            }
+            p = next;
         }
+        if(head != 0) a.free_list[idx].push(head, tail);
+
+        for(Superblock** link = &a.spans[idx]; *link != 0;) {
+            Superblock* sb = *link;
+            if(sb->scratch < 0) {
+                *link = sb->next;
+                if(a.current[idx] == sb) a.current[idx] = 0;
+                PageMap::set(sb, PageHeap::SUPERBLOCK_SIZE, 0);
+                a.pages.release((char*)sb);
+            }
+            else
+                link = &sb->next;
+        }
+    }
+
+}
+
+size_t AllocImpl::trim(size_t keep_bytes)
+{
+    // the objects the caller cached go back first, a thread without a cache gets none
+    if(ThreadCache* cache = ThreadCache::attached(*this))
+        cache->flushAll();
+
+    // every arena keeps a share of the resident superblocks
+    size_t released = 0;
+    int n = arenaCount();
+    for(int node = 0; node < MAX_NODES; ++node) {
+        NodeArena* a = arenas[node].load(std::memory_order_acquire);
+        if(a == 0) continue;
+        trim(*a);
+        released += a->pages.scavenge(keep_bytes / n);
+    }
+    return released;
+}
 
-        start_free = (char*)malloc(bytes_to_get);
-        if(0 == start_free) {
-            end_free = 0;
-            start_free = (char*)AllocPrime::allocate(bytes_to_get);
+void AllocImpl::stats(AllocStats &st)
+{
+    st.classes.resize(NFREELISTS);
+    st.retries = 0;
+    st.superblock_bytes = 0;
+    st.arenas = 0;
+    st.remote_frees = remote_frees.load(std::memory_order_relaxed);
+
+    for(int idx = 0; idx < NFREELISTS; ++idx) {
+        AllocStats::SizeClass& c = st.classes[idx];
+        c.size = class_size[idx];
+        c.allocs = retired_allocs[idx].load(std::memory_order_relaxed);
+        c.frees = retired_frees[idx].load(std::memory_order_relaxed);
+        c.refills = retired_refills[idx].load(std::memory_order_relaxed);
+        c.retries = 0;
+        c.superblocks = 0;
+        c.free = 0;
+        c.batch = 0;
+    }
+
+    for(int node = 0; node < MAX_NODES; ++node) {
+        NodeArena* a = arenas[node].load(std::memory_order_acquire);
+        if(a == 0) continue;
+        ++st.arenas;
+        st.superblock_bytes += a->pages.mapped();
+
+        for(int idx = 0; idx < NFREELISTS; ++idx) {
+            AllocStats::SizeClass& c = st.classes[idx];
+            c.retries += a->free_list[idx].retries.load(std::memory_order_relaxed);
+
+            std::unique_lock<std::mutex> lock(a->carveMutex[idx]);
+            for(Superblock* sb = a->spans[idx]; sb != 0; sb = sb->next) {
+                c.free += sb->carved;
+                ++c.superblocks;
+            }
         }
-        heap_size += bytes_to_get;
-        end_free  = start_free + bytes_to_get;
-        chunk_allocRD = true;
-        poolRD = true;
-        return (chunk_alloc(size, nobjs));
+    }
+
+    ThreadCache::stats(*this, st);
+
+    for(int idx = 0; idx < NFREELISTS; ++idx) {
+        AllocStats::SizeClass& c = st.classes[idx];
+        size_t carved = c.free;
+        st.retries += c.retries;
+        c.live = c.allocs > c.frees ? c.allocs - c.frees : 0;
+        c.free = carved > c.live ? carved - c.live : 0;
+        if(FixedBatch(idx) > 0) c.batch = FixedBatch(idx);
     }
 }
 
 
 
-//////////////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void *Alloc::allocate(size_t n)
+ThreadCache* ThreadCache::current()
 {
-    return AllocImpl::Instance().allocate(n);
+    ThreadCache* cache = &t_cache;
+    if(cache->state == ACTIVE) return cache;
+    if(cache->state == DEAD) return 0;
+
+    // the first touch registers the destructor that drains this thread. that may
+    // malloc, which under LD_PRELOAD comes back here, so attach before
+    cache->attach(AllocImpl::Instance());
+    t_cacheReaper.touched = 1;
+    return cache;
 }
 
-void Alloc::deallocate(void *p, size_t n)
+ThreadCache* ThreadCache::current(AllocImpl &heap)
 {
-    return AllocImpl::Instance().deallocate(p, n);
+    if(heap.id < 0) return 0;
+    ThreadCache* cache = t_heapCaches[heap.id];
+    if(cache != 0 && cache->state == ACTIVE && cache->heap == &heap && cache->generation == heap.generation)
+        return cache;
+    if(t_cache.state == DEAD) return 0;
+
+    if(cache == 0) {
+        cache = (ThreadCache*)OsMap(sizeof(ThreadCache), 0);
+        if(cache == 0) return 0;
+        t_heapCaches[heap.id] = cache;
+    }
+    else {
+        // left over from a destroyed heap of the same id, its objects died with it
+        memset((void*)cache, 0, sizeof(ThreadCache));
+    }
+
+    cache->attach(heap);
+    t_cacheReaper.touched = 1;
+    return cache;
 }
 
-void *Alloc::reallocate(void *p, size_t old_sz, size_t new_sz)
+/// the cache the calling thread already has for heap, 0 rather than attaching one
+ThreadCache* ThreadCache::attached(AllocImpl &heap)
 {
-    return AllocImpl::Instance().reallocate(p, old_sz, new_sz);
+    if(heap.id < 0) return 0;
+    ThreadCache* cache = heap.id == 0 ? &t_cache : t_heapCaches[heap.id];
+    if(cache != 0 && cache->state == ACTIVE && cache->heap == &heap && cache->generation == heap.generation)
+        return cache;
+    return 0;
 }
 
-void (* Alloc::set_oom_malloc_handler(void (*f)())) ()
+void ThreadCache::attach(AllocImpl &heap)
 {
-    return AllocPrime::set_oom_malloc_handler(f);
+    this->heap = &heap;
+    generation = heap.generation;
+    seq = threads.fetch_add(1, std::memory_order_relaxed);
+    node = heap.CurrentNode(seq);
+    state = ACTIVE;
+
+    std::unique_lock<std::mutex> lock(heap.registryMutex);
+    prev = 0;
+    next = heap.registry;
+    if(heap.registry) heap.registry->prev = this;
+    heap.registry = this;
 }
 
-
-int Alloc::setDefaultNodeNum(int nn)
+void ThreadCache::retire()
 {
-    int nn_old = g_defaultNodeNum;
+    std::unique_lock<std::mutex> lock(heap->registryMutex);
 
-    g_defaultNodeNum = nn;
-    return nn_old;
+    for(int i = 0; i < AllocImpl::NFREELISTS; ++i) {
+        heap->retired_allocs[i].fetch_add(allocs[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        heap->retired_frees[i].fetch_add(frees[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        heap->retired_refills[i].fetch_add(refills[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    if(prev) prev->next = next;
+    else     heap->registry = next;
+    if(next) next->prev = prev;
+    state = DEAD;
 }
 
-int Alloc::setInitPoolSize(int ps)
+/// drains every cache of an exiting thread, the caches of destroyed heaps are dropped
+void ThreadCache::retireAll()
 {
-    int ps_old = g_InitPoolSize;
+    if(t_cache.state == ACTIVE) {
+        t_cache.flushAll();
+        t_cache.retire();
+    }
+    t_cache.state = DEAD;
+
+    for(int i = 1; i < AllocImpl::MAX_HEAPS; ++i) {
+        ThreadCache* cache = t_heapCaches[i];
+        if(cache == 0) continue;
+        {
+            std::unique_lock<std::mutex> lock(g_heapsMutex);
+            if(cache->state == ACTIVE && g_heaps[i] == cache->heap && cache->heap->generation == cache->generation) {
+                cache->flushAll();
+                cache->retire();
+            }
+        }
+        t_heapCaches[i] = 0;
+        OsUnmap(cache, sizeof(ThreadCache));
+    }
+}
+
+void ThreadCache::stats(AllocImpl &heap, AllocStats &st)
+{
+    std::unique_lock<std::mutex> lock(heap.registryMutex);
+    st.threads = 0;
+
+    for(ThreadCache* c = heap.registry; c != 0; c = c->next) {
+        for(int i = 0; i < AllocImpl::NFREELISTS; ++i) {
+            st.classes[i].allocs += c->allocs[i].load(std::memory_order_relaxed);
+            st.classes[i].frees += c->frees[i].load(std::memory_order_relaxed);
+            st.classes[i].refills += c->refills[i].load(std::memory_order_relaxed);
+            st.classes[i].batch = std::max(st.classes[i].batch, (size_t)c->batch[i].load(std::memory_order_relaxed));
+        }
+        ++st.threads;
+    }
+}
+
+void* ThreadCache::allocate(AllocImpl &heap, int idx)
+{
+    AllocImpl::obj* result = free_list[idx];
+
+    bump(allocs[idx]);
+    if(result != 0) {
+        free_list[idx] = result->free_list_link;
+        --length[idx];
+        return result;
+    }
+
+    bump(refills[idx]);
+    int nobjs = grow(heap, idx);
+    followNode(heap);
+    result = heap.fetch(node, idx, nobjs);
+    if(result == 0) return 0;
+    free_list[idx] = result->free_list_link;
+    length[idx] = nobjs - 1;
+    return result;
+}
+
+/// the cached objects go first, the shared lists serve the rest in one go
+size_t ThreadCache::allocate_batch(AllocImpl &heap, int idx, size_t count, void **out)
+{
+    size_t got = 0;
+    while(got < count && free_list[idx] != 0) {
+        out[got++] = free_list[idx];
+        free_list[idx] = free_list[idx]->free_list_link;
+        --length[idx];
+    }
+
+    if(got < count) {
+        bump(refills[idx]);
+        followNode(heap);
+        got += heap.fetch_batch(node, idx, count - got, out + got);
+    }
+
+    // a short fill after running out of memory counts only what it handed out
+    bump(allocs[idx], got);
+    return got;
+}
+
+void ThreadCache::deallocate(AllocImpl &heap, void *p, int idx)
+{
+    AllocImpl::obj* q = (AllocImpl::obj*)p;
+
+    bump(frees[idx]);
+    if(heap.nodes.load(std::memory_order_relaxed) > 1 && AllocImpl::SuperblockOf(p)->node != node) {
+        // a thread moved to another node sees its new local memory as remote, so
+        // every few remote frees it looks where it runs now
+        if(++remote_seen % NODE_CHECK == 0)
+            followNode(heap);
+        if(AllocImpl::SuperblockOf(p)->node != node) {
+            // remote memory goes straight back to the arena of its node
+            heap.remote_frees.fetch_add(1, std::memory_order_relaxed);
+            q->free_list_link = 0;
+            heap.release(idx, q, q);
+            return;
+        }
+    }
+    q->free_list_link = free_list[idx];
+    free_list[idx] = q;
+    if(++length[idx] > 2 * batchOf(heap, idx))
+        flush(heap, idx, grow(heap, idx));
+}
+
+/// the batch of the next refill or flush of idx. an adaptive one doubles each
+/// time, so a class in steady use soon moves its objects in large batches
+int ThreadCache::grow(AllocImpl &heap, int idx)
+{
+    if(++slow_paths % IDLE_SCAN == 0)
+        shrinkIdle(heap);
+
+    int fixed = heap.FixedBatch(idx);
+    if(fixed > 0) return fixed;
+
+    int b = batch[idx].load(std::memory_order_relaxed);
+    b = b == 0 ? (int)AllocImpl::MIN_BATCH : std::min(2 * b, heap.BatchLimit(idx));
+    batch[idx].store(b, std::memory_order_relaxed);
+    return b;
+}
+
+/// a class neither allocated nor freed since the last scan halves its batch and
+/// gives what its list holds beyond the new batch back to the shared lists
+void ThreadCache::shrinkIdle(AllocImpl &heap)
+{
+    for(int i = 0; i < AllocImpl::NFREELISTS; ++i) {
+        uint64_t mark = allocs[i].load(std::memory_order_relaxed) + frees[i].load(std::memory_order_relaxed);
+        if(mark != idle_mark[i]) {
+            idle_mark[i] = mark;
+            continue;
+        }
+
+        int b = batch[i].load(std::memory_order_relaxed);
+        if(b > AllocImpl::MIN_BATCH)
+            batch[i].store(b / 2, std::memory_order_relaxed);
+        int keep = batchOf(heap, i);
+        if(length[i] > keep)
+            flush(heap, i, length[i] - keep);
+    }
+}
+
+/// at most the whole list: the batch a caller read may have moved since, through
+/// setNodeNum or a shrinkIdle that flushed the class already
+void ThreadCache::flush(AllocImpl &heap, int idx, int nobjs)
+{
+    if(nobjs > length[idx]) nobjs = length[idx];
+    if(nobjs <= 0) return;
+
+    AllocImpl::obj* head = free_list[idx];
+    AllocImpl::obj* tail = head;
+    for(int i = 1; i < nobjs; ++i)
+        tail = tail->free_list_link;
+
+    free_list[idx] = tail->free_list_link;
+    length[idx] -= nobjs;
+    heap.release(idx, head, tail);
+}
+
+/// a thread moved to another node gives its cached objects back to the arenas of
+/// their nodes and refills from the arena of the new one from now on
+void ThreadCache::followNode(AllocImpl &heap)
+{
+    int now = heap.CurrentNode(seq);
+    if(now == node) return;
+    flushAll();
+    node = now;
+}
+
+void ThreadCache::flushAll()
+{
+    for(int i = 0; i < AllocImpl::NFREELISTS; ++i) {
+        if(length[i] > 0)
+            flush(*heap, i, length[i]);
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////
+/// \brief samples the allocations of Alloc about once every
+///        g_sampleInterval bytes. the bytes to the next sample are drawn
+///        from an exponential distribution, so every allocated byte is
+///        equally likely to be sampled whatever the allocation sizes.
+///        a sample records the stack of the allocation: stacks collect
+///        the counts of the allocated profile, and the samples still
+///        alive make up the live profile. frees look a pointer up in the
+///        live table without a lock, and only while samples are alive
+//////////////////////////////////////////////////////////////////////////
+class HeapProfiler {
+public:
+    enum {
+        MAX_DEPTH = 32,
+        SKIP_FRAMES = 2,                    ///< record() and the Alloc entry point
+        STACKS = 1 << 14,
+        LIVE = 1 << 16,
+        TOMBSTONE = 1,
+        RECHECK_BYTES = 1 << 20             ///< bytes between two looks at the interval while off
+    };
+
+    struct Stack {
+        uint64_t  hash;
+        int       depth;
+        void*     pcs[MAX_DEPTH];
+        uint64_t  allocs;                   ///< samples taken at this stack
+        uint64_t  alloc_bytes;              ///< their sizes
+        double    alloc_weight;             ///< the bytes they stand for
+    };
+
+    struct Live {
+        std::atomic<uintptr_t>  ptr;        ///< 0 empty, TOMBSTONE freed
+        size_t    size;
+        double    weight;
+        Stack*    stack;
+    };
+
+    static void start();
+    static void record(void* p, size_t n);
+    static void forget(void* p);
+    static int64_t nextSample(size_t interval);
+
+    static size_t home(uintptr_t key, size_t cap) {
+        return (size_t)((key >> 4) * 0x9e3779b97f4a7c15ULL >> 20) & (cap - 1);
+    }
+
+    static std::mutex  mutex;
+    static std::atomic<Stack*> stacks;      ///< open addressing by stack hash, mapped by start()
+    static std::atomic<Live*>  live;        ///< open addressing by pointer, published last by start()
+    static size_t      stacksUsed;
+    static size_t      liveUsed;            ///< slots holding a sample or a tombstone
+
+private:
+    static Stack* find(void** pcs, int depth);
+};
+
+std::mutex              HeapProfiler::mutex;
+std::atomic<HeapProfiler::Stack*> HeapProfiler::stacks(0);
+std::atomic<HeapProfiler::Live*>  HeapProfiler::live(0);
+size_t                  HeapProfiler::stacksUsed = 0;
+size_t                  HeapProfiler::liveUsed = 0;
+
+static thread_local int64_t  t_untilSample = 0;     ///< bytes the thread allocates before its next sample
+static thread_local uint64_t t_sampleRandom = 0;
+static thread_local bool     t_inProfiler = false;  ///< the profiler's own allocations are not sampled
+
+void HeapProfiler::start()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(live.load(std::memory_order_relaxed) != 0) return;
+
+    // the first backtrace() loads the unwinder, which allocates
+    void* pcs[1];
+    backtrace(pcs, 1);
+
+    Stack* counts;
+    while((counts = (Stack*)OsMap(STACKS * sizeof(Stack), 0)) == 0)
+        AllocPrime::call_oom_handler();
+    stacks.store(counts, std::memory_order_relaxed);
+    Live* table;
+    while((table = (Live*)OsMap(LIVE * sizeof(Live), 0)) == 0)
+        AllocPrime::call_oom_handler();
+    live.store(table, std::memory_order_release);
+}
+
+int64_t HeapProfiler::nextSample(size_t interval)
+{
+    if(interval == 0) return RECHECK_BYTES;
+
+    uint64_t x = t_sampleRandom;
+    if(x == 0) x = (uintptr_t)&t_sampleRandom ^ (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count() ^ 1;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    t_sampleRandom = x;
+
+    double u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);    // (0, 1]
+    return (int64_t)(-log(u) * interval) + 1;
+}
+
+HeapProfiler::Stack* HeapProfiler::find(void** pcs, int depth)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for(int i = 0; i < depth; ++i)
+        hash = (hash ^ (uintptr_t)pcs[i]) * 1099511628211ULL;
+    hash |= 1;
+
+    Stack* table = stacks.load(std::memory_order_relaxed);
+    for(size_t i = home(hash, STACKS);; i = (i + 1) & (STACKS - 1)) {
+        Stack* s = &table[i];
+        if(s->hash == hash && s->depth == depth && memcmp(s->pcs, pcs, depth * sizeof(void*)) == 0)
+            return s;
+        if(s->hash == 0) {
+            if((stacksUsed + 1) * 4 > (size_t)STACKS * 3) return 0;
+            ++stacksUsed;
+            s->hash = hash;
+            s->depth = depth;
+            memcpy(s->pcs, pcs, depth * sizeof(void*));
+            return s;
+        }
+    }
+}
+
+__attribute__((noinline)) void HeapProfiler::record(void *p, size_t n)
+{
+    size_t interval = g_sampleInterval.load(std::memory_order_relaxed);
+    t_untilSample = nextSample(interval);
+    Live* live = HeapProfiler::live.load(std::memory_order_acquire);
+    if(interval == 0 || t_inProfiler || live == 0) return;
+    t_inProfiler = true;
+
+    void* pcs[MAX_DEPTH + SKIP_FRAMES];
+    int depth = backtrace(pcs, MAX_DEPTH + SKIP_FRAMES) - SKIP_FRAMES;
+    if(depth < 0) depth = 0;
+
+    // a sample of n bytes stands for n / P(sampled) bytes
+    double size = n ? (double)n : 1.0;
+    double weight = size / (1.0 - exp(-size / interval));
+
+    std::unique_lock<std::mutex> lock(mutex);
+    Stack* s = find(pcs + SKIP_FRAMES, depth);
+    if(s != 0) {
+        ++s->allocs;
+        s->alloc_bytes += n;
+        s->alloc_weight += weight;
+
+        size_t slot = (size_t)-1;
+        size_t i = home((uintptr_t)p, LIVE);
+        for(; live[i].ptr.load(std::memory_order_relaxed) != 0; i = (i + 1) & (LIVE - 1))
+            if(slot == (size_t)-1 && live[i].ptr.load(std::memory_order_relaxed) == TOMBSTONE)
+                slot = i;
+        if(slot == (size_t)-1 && (liveUsed + 1) * 4 <= (size_t)LIVE * 3) {
+            slot = i;
+            ++liveUsed;
+        }
+
+        if(slot != (size_t)-1) {
+            live[slot].size = n;
+            live[slot].weight = weight;
+            live[slot].stack = s;
+            live[slot].ptr.store((uintptr_t)p, std::memory_order_release);
+            g_liveSamples.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    lock.unlock();
+    t_inProfiler = false;
+}
+
+void HeapProfiler::forget(void *p)
+{
+    Live* live = HeapProfiler::live.load(std::memory_order_acquire);
+    if(t_inProfiler || p == 0 || live == 0) return;
+
+    size_t i = home((uintptr_t)p, LIVE);
+    for(uintptr_t key; (key = live[i].ptr.load(std::memory_order_acquire)) != 0; i = (i + 1) & (LIVE - 1)) {
+        if(key != (uintptr_t)p) continue;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        live[i].ptr.store(TOMBSTONE, std::memory_order_relaxed);
+        g_liveSamples.fetch_sub(1, std::memory_order_relaxed);
+
+        // a tombstone at the end of a probe chain ends no search, clear it and the ones before
+        while(live[(i + 1) & (LIVE - 1)].ptr.load(std::memory_order_relaxed) == 0 &&
+              live[i].ptr.load(std::memory_order_relaxed) == TOMBSTONE) {
+            live[i].ptr.store(0, std::memory_order_relaxed);
+            --liveUsed;
+            i = (i - 1) & (LIVE - 1);
+        }
+        return;
+    }
+}
+
+/// counts n bytes against the calling thread's distance to its next sample
+static inline void* Sampled(void* p, size_t n)
+{
+    if((t_untilSample -= (int64_t)n) < 0 && p != 0)
+        HeapProfiler::record(p, n);
+    return p;
+}
+
+static inline void Unsampled(void* p)
+{
+    if(g_liveSamples.load(std::memory_order_relaxed) != 0)
+        HeapProfiler::forget(p);
+}
+
+/// a failed reallocation keeps p and so its sample, the sample moves only with the block
+static inline void* Resampled(void* p, void* result, size_t n)
+{
+    if(result != 0) {
+        Unsampled(p);
+        Sampled(result, n);
+    }
+    return result;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+/// fork() copies only the calling thread, a lock another thread held at that
+/// moment would stay taken in the child forever. so the locks are taken
+/// before the fork, outermost first, and given back on both sides after
+//////////////////////////////////////////////////////////////////////////
+
+void AllocImpl::lockAll()
+{
+    registryMutex.lock();
+    arenaMutex.lock();
+    for(int node = 0; node < MAX_NODES; ++node) {
+        NodeArena* a = arenas[node].load(std::memory_order_acquire);
+        if(a == 0) continue;
+        for(int idx = 0; idx < NFREELISTS; ++idx)
+            a->carveMutex[idx].lock();
+        a->pages.lock();
+    }
+    if(large != 0) large->lock();
+}
+
+void AllocImpl::unlockAll()
+{
+    if(large != 0) large->unlock();
+    for(int node = MAX_NODES - 1; node >= 0; --node) {
+        NodeArena* a = arenas[node].load(std::memory_order_acquire);
+        if(a == 0) continue;
+        a->pages.unlock();
+        for(int idx = NFREELISTS - 1; idx >= 0; --idx)
+            a->carveMutex[idx].unlock();
+    }
+    arenaMutex.unlock();
+    registryMutex.unlock();
+}
+
+static void ForkPrepare()
+{
+    HeapProfiler::mutex.lock();
+    g_heapsMutex.lock();
+    AllocImpl::Instance().lockAll();
+    for(int i = 1; i < AllocImpl::MAX_HEAPS; ++i)
+        if(g_heaps[i] != 0) g_heaps[i]->lockAll();
+    if(ProvisionerState* st = g_provisioner.load(std::memory_order_acquire))
+        st->mutex.lock();
+    AllocPrime::lock();
+    PageMap::lock();
+}
+
+static void ForkParent()
+{
+    PageMap::unlock();
+    AllocPrime::unlock();
+    if(ProvisionerState* st = g_provisioner.load(std::memory_order_acquire))
+        st->mutex.unlock();
+    for(int i = AllocImpl::MAX_HEAPS - 1; i >= 1; --i)
+        if(g_heaps[i] != 0) g_heaps[i]->unlockAll();
+    AllocImpl::Instance().unlockAll();
+    g_heapsMutex.unlock();
+    HeapProfiler::mutex.unlock();
+}
+
+/// the caches of the other threads are lost with them, their objects leak in the child.
+/// so is the provisioner, the next setProvisioning of the child starts one again
+static void ForkChild()
+{
+    if(ProvisionerState* st = g_provisioner.load(std::memory_order_acquire))
+        st->started = false;
+    ForkParent();
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void *Alloc::allocate(size_t n)
+{
+    return Sampled(AllocImpl::Instance().allocate(n), n);
+}
+
+void Alloc::deallocate(void *p, size_t n)
+{
+    Unsampled(p);
+    return AllocImpl::Instance().deallocate(p, n);
+}
+
+void *Alloc::reallocate(void *p, size_t old_sz, size_t new_sz)
+{
+    return Resampled(p, AllocImpl::Instance().reallocate(p, old_sz, new_sz), new_sz);
+}
+
+void *Alloc::allocate_aligned(size_t n, size_t alignment)
+{
+    return Sampled(AllocImpl::Instance().allocate_aligned(n, alignment), n);
+}
+
+void Alloc::deallocate_aligned(void *p, size_t n, size_t alignment)
+{
+    Unsampled(p);
+    AllocImpl::Instance().deallocate_aligned(p, n, alignment);
+}
+
+void Alloc::deallocate(void *p)
+{
+    Unsampled(p);
+    AllocImpl::Instance().deallocate(p);
+}
+
+size_t Alloc::allocate_batch(size_t n, size_t count, void **out)
+{
+    size_t got = AllocImpl::Instance().allocate_batch(n, count, out);
+    for(size_t i = 0; i < got; ++i)
+        Sampled(out[i], n);
+    return got;
+}
+
+void Alloc::deallocate_batch(void **ptrs, size_t count, size_t n)
+{
+    if(g_liveSamples.load(std::memory_order_relaxed) != 0)
+        for(size_t i = 0; i < count; ++i)
+            HeapProfiler::forget(ptrs[i]);
+    AllocImpl::Instance().deallocate_batch(ptrs, count, n);
+}
+
+size_t Alloc::usable_size(void *p)
+{
+    return AllocImpl::Instance().usable_size(p);
+}
+
+void *Alloc::reallocate(void *p, size_t new_sz)
+{
+    AllocImpl& heap = AllocImpl::Instance();
+    return Resampled(p, heap.reallocate(p, heap.usable_size(p), new_sz), new_sz);
+}
+
+/// t_oomFails for the duration of a try_ call
+struct OomFails {
+    bool saved;
+    OomFails() : saved(t_oomFails) { t_oomFails = true; }
+    ~OomFails() { t_oomFails = saved; }
+};
+
+void *Alloc::try_allocate(size_t n)
+{
+    OomFails fails;
+    return allocate(n);
+}
+
+void *Alloc::try_allocate_aligned(size_t n, size_t alignment)
+{
+    OomFails fails;
+    return allocate_aligned(n, alignment);
+}
+
+void *Alloc::try_reallocate(void *p, size_t new_sz)
+{
+    OomFails fails;
+    return reallocate(p, new_sz);
+}
+
+void (* Alloc::set_oom_malloc_handler(void (*f)())) ()
+{
+    return AllocPrime::set_oom_malloc_handler(f);
+}
+
+size_t Alloc::trim(size_t keep_bytes)
+{
+    size_t released = AllocImpl::Instance().trim(keep_bytes);
+    return released + AllocPrime::trim(0);
+}
+
+
+int Alloc::setDefaultNodeNum(int nn, size_t bytes)
+{
+    return AllocImpl::Instance().setNodeNum(nn, bytes);
+}
+
+int Alloc::setInitPoolSize(int ps)
+{
+    int ps_old = g_InitPoolSize;
 
     g_InitPoolSize = ps;
     return ps_old;
 }
 
+int Alloc::setNumaNodes(int nodes)
+{
+    AllocImpl& heap = AllocImpl::Instance();
+    g_numaSimulated = nodes;
+    return heap.setNodes(nodes);
+}
+
+size_t Alloc::setLargeCacheLimit(size_t bytes)
+{
+    size_t bytes_old = g_largeCacheLimit;
+
+    g_largeCacheLimit = bytes;
+    return bytes_old;
+}
+
+int Alloc::setLargeCacheDecay(int ms)
+{
+    int ms_old = g_largeCacheDecay;
+
+    g_largeCacheDecay = ms;
+    return ms_old;
+}
+
+bool Alloc::setHugePage(bool enable)
+{
+    bool enable_old = g_largeHugePage;
+
+    g_largeHugePage = enable;
+    return enable_old;
+}
+
+AllocStats Alloc::stats()
+{
+    AllocStats st;
+    AllocImpl::Instance().stats(st);
+    AllocPrime::stats(st);
+
+    st.reserved_bytes = g_osBytes.load(std::memory_order_relaxed);
+    st.peak_bytes = g_osPeak.load(std::memory_order_relaxed);
+    st.os_calls = g_osCalls.load(std::memory_order_relaxed);
+    return st;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+Heap::Heap(int node_num, int init_pool_size)
+    : impl(new AllocImpl(node_num, init_pool_size))
+{
+    impl->enroll();
+}
+
+Heap::~Heap()
+{
+    impl->destroy();
+    delete impl;
+}
+
+void *Heap::allocate(size_t n)
+{
+    return impl->allocate(n);
+}
+
+void Heap::deallocate(void *p, size_t n)
+{
+    impl->deallocate(p, n);
+}
+
+void Heap::deallocate(void *p)
+{
+    impl->deallocate(p);
+}
+
+void *Heap::reallocate(void *p, size_t old_sz, size_t new_sz)
+{
+    return impl->reallocate(p, old_sz, new_sz);
+}
+
+void *Heap::allocate_aligned(size_t n, size_t alignment)
+{
+    return impl->allocate_aligned(n, alignment);
+}
+
+void Heap::deallocate_aligned(void *p, size_t n, size_t alignment)
+{
+    impl->deallocate_aligned(p, n, alignment);
+}
+
+size_t Heap::allocate_batch(size_t n, size_t count, void **out)
+{
+    return impl->allocate_batch(n, count, out);
+}
+
+void Heap::deallocate_batch(void **ptrs, size_t count, size_t n)
+{
+    impl->deallocate_batch(ptrs, count, n);
+}
+
+size_t Heap::usable_size(void *p)
+{
+    return impl->usable_size(p);
+}
+
+size_t Heap::trim(size_t keep_bytes)
+{
+    return impl->trim(keep_bytes);
+}
+
+AllocStats Heap::stats()
+{
+    AllocStats st;
+    impl->stats(st);
+
+    st.large_bytes = impl->large_span_bytes();
+    st.large_cached_bytes = 0;
+    st.reserved_bytes = g_osBytes.load(std::memory_order_relaxed);
+    st.peak_bytes = g_osPeak.load(std::memory_order_relaxed);
+    st.os_calls = g_osCalls.load(std::memory_order_relaxed);
+    return st;
+}
+
+int Heap::setNodeNum(int nn, size_t bytes)
+{
+    return impl->setNodeNum(nn, bytes);
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+/// the segment starts with its header and a bitmap with a bit for every
+/// BLOCK_HEADER bytes, set where a block starts; the blocks follow. every
+/// block has BLOCK_HEADER bytes in front of its buffer: the class, a state
+/// word and the offset of the next free block. classes step by a quarter of
+/// a power of two from 256 bytes on, so a block wastes at most 25%
+//////////////////////////////////////////////////////////////////////////
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the shared free lists need lock-free 64 bit atomics");
+
+enum {
+    SHARED_HEADER = 4096,                   ///< the segment header, the bitmap of block starts follows
+    SHARED_CLASSES = 4 * 41,                ///< enough for blocks up to 2^OFFSET_BITS bytes
+    BLOCK_HEADER = 64,
+    OFFSET_BITS = 48,                       ///< a tagged list head keeps the offset below, an ABA tag above
+    BLOCK_USED = 0x75736564,
+    BLOCK_FREE = 0x66726565
+};
+
+static const uint64_t SHARED_MAGIC = 0x6c6f6f7064726873ULL;
+static const uint64_t OFFSET_MASK = ((uint64_t)1 << OFFSET_BITS) - 1;
+
+struct SharedPool::Segment {
+    uint64_t              magic;
+    uint64_t              size;
+    std::atomic<uint64_t> top;              ///< offset of the part not carved yet
+    std::atomic<uint64_t> buffers;
+    std::atomic<uint64_t> free_list[SHARED_CLASSES];
+};
+
+/// the offset of the first block of a segment of size bytes, behind the bitmap
+static uint64_t SharedFirstBlock(uint64_t size)
+{
+    uint64_t words = (size / BLOCK_HEADER + 63) / 64;
+    return SHARED_HEADER + ((words * 8 + BLOCK_HEADER - 1) & ~(uint64_t)(BLOCK_HEADER - 1));
+}
+
+struct SharedBlock {
+    uint32_t              cls;
+    std::atomic<uint32_t> state;
+    uint64_t              next;             ///< offset of the next free block, while free
+};
+
+static uint64_t SharedClassBytes(int cls)
+{
+    return (uint64_t)(4 + (cls & 3)) << (cls >> 2) << 6;
+}
+
+/// the smallest class of blocks of at least bytes
+static int SharedClassOf(uint64_t bytes)
+{
+    uint64_t units = (bytes + 63) >> 6;
+    if(units <= 4) return 0;
+    int e = 63 - __builtin_clzll(units - 1) - 2;
+    uint64_t steps = ((units - 1) >> e) + 1;   // ceil(units / 2^e), 5 to 8
+    return e * 4 + (int)(steps - 4);
+}
+
+SharedPool::SharedPool(int file, char *base, size_t bytes)
+    : file(file), base(base), bytes(bytes)
+{
+}
+
+SharedPool::~SharedPool()
+{
+    munmap(base, bytes);
+    close(file);
+}
+
+SharedPool* SharedPool::map(int file, bool init)
+{
+    static_assert(sizeof(Segment) <= (size_t)SHARED_HEADER, "the segment header outgrew its page");
+
+    struct stat st;
+    if(fstat(file, &st) != 0 || (size_t)st.st_size < (size_t)SHARED_HEADER) {
+        close(file);
+        return 0;
+    }
+
+    size_t bytes = (size_t)st.st_size;
+    char* base = (char*)mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if(base == MAP_FAILED) {
+        close(file);
+        return 0;
+    }
+
+    // a fresh segment is zero, i.e. every list is empty
+    Segment* seg = (Segment*)base;
+    if(init) {
+        seg->size = bytes;
+        seg->top.store(SharedFirstBlock(bytes), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        seg->magic = SHARED_MAGIC;
+    }
+    else if(seg->magic != SHARED_MAGIC || seg->size != bytes) {
+        munmap(base, bytes);
+        close(file);
+        return 0;
+    }
+    return new SharedPool(file, base, bytes);
+}
+
+SharedPool* SharedPool::create(const char *name, size_t bytes)
+{
+    if(bytes < (size_t)SHARED_HEADER || bytes < SharedFirstBlock(bytes) || bytes > OFFSET_MASK) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    int file = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)
+                    : memfd_create("pi::SharedPool", MFD_CLOEXEC);
+    if(file < 0) return 0;
+    if(ftruncate(file, (off_t)bytes) != 0) {
+        int saved = errno;
+        close(file);
+        if(name) shm_unlink(name);
+        errno = saved;
+        return 0;
+    }
+
+    SharedPool* pool = map(file, true);
+    if(pool == 0 && name) shm_unlink(name);
+    return pool;
+}
+
+SharedPool* SharedPool::open(const char *name)
+{
+    int file = shm_open(name, O_RDWR, 0);
+    return file < 0 ? 0 : map(file, false);
+}
+
+SharedPool* SharedPool::open(int fd)
+{
+    int file = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    return file < 0 ? 0 : map(file, false);
+}
+
+bool SharedPool::remove(const char *name)
+{
+    return shm_unlink(name) == 0;
+}
+
+SharedPool::Handle SharedPool::getBuffer(size_t n)
+{
+    if(n > bytes) return 0;
+    int cls = SharedClassOf(n + BLOCK_HEADER);
+    Segment* seg = segment();
+    std::atomic<uint64_t>& list = seg->free_list[cls];
+
+    // a list head is read without a lock, the tag tells a head that was
+    // popped and pushed again meanwhile; a block read stale stays mapped
+    uint64_t head = list.load(std::memory_order_acquire);
+    uint64_t block = 0;
+    while((head & OFFSET_MASK) != 0) {
+        SharedBlock* b = (SharedBlock*)(base + (head & OFFSET_MASK));
+        uint64_t next = ((head >> OFFSET_BITS) + 1) << OFFSET_BITS | b->next;
+        if(list.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+            block = head & OFFSET_MASK;
+            break;
+        }
+    }
+
+    if(block == 0) {
+        uint64_t size = SharedClassBytes(cls);
+        uint64_t top = seg->top.load(std::memory_order_relaxed);
+        do {
+            if(size > bytes - top) return 0;
+        } while(!seg->top.compare_exchange_weak(top, top + size, std::memory_order_relaxed));
+        block = top;
+        ((SharedBlock*)(base + block))->cls = cls;
+
+        // blocks are never split or merged, the bit stays set for good
+        std::atomic<uint64_t>* starts = (std::atomic<uint64_t>*)(base + SHARED_HEADER);
+        uint64_t unit = block / BLOCK_HEADER;
+        starts[unit / 64].fetch_or((uint64_t)1 << (unit % 64), std::memory_order_release);
+    }
+
+    SharedBlock* b = (SharedBlock*)(base + block);
+    b->state.store(BLOCK_USED, std::memory_order_relaxed);
+    seg->buffers.fetch_add(1, std::memory_order_relaxed);
+    return block + BLOCK_HEADER;
+}
+
+void SharedPool::returnBuffer(Handle handle)
+{
+    if(resolve(handle) == 0) return;
+    uint64_t block = handle - BLOCK_HEADER;
+    SharedBlock* b = (SharedBlock*)(base + block);
+
+    uint32_t used = BLOCK_USED;
+    if(b->cls >= (uint32_t)SHARED_CLASSES ||
+       !b->state.compare_exchange_strong(used, BLOCK_FREE, std::memory_order_relaxed))
+        return;
+
+    Segment* seg = segment();
+    seg->buffers.fetch_sub(1, std::memory_order_relaxed);
+    std::atomic<uint64_t>& list = seg->free_list[b->cls];
+    uint64_t head = list.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        b->next = head & OFFSET_MASK;
+        next = ((head >> OFFSET_BITS) + 1) << OFFSET_BITS | block;
+    } while(!list.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+}
+
+/// only the buffer of a carved block resolves, whatever the bytes in front of
+/// another offset look like
+void* SharedPool::resolve(Handle handle) const
+{
+    if(handle < SharedFirstBlock(bytes) + BLOCK_HEADER || handle >= bytes || (handle & (BLOCK_HEADER - 1)) != 0)
+        return 0;
+
+    const std::atomic<uint64_t>* starts = (const std::atomic<uint64_t>*)(base + SHARED_HEADER);
+    uint64_t unit = (handle - BLOCK_HEADER) / BLOCK_HEADER;
+    if((starts[unit / 64].load(std::memory_order_acquire) & ((uint64_t)1 << (unit % 64))) == 0)
+        return 0;
+    return base + handle;
+}
+
+SharedPool::Handle SharedPool::handleOf(const void *buffer) const
+{
+    return resolve((const char*)buffer - base) ? (Handle)((const char*)buffer - base) : 0;
+}
+
+size_t SharedPool::bufferSize(Handle handle) const
+{
+    if(resolve(handle) == 0) return 0;
+    SharedBlock* b = (SharedBlock*)(base + handle - BLOCK_HEADER);
+    return b->cls < (uint32_t)SHARED_CLASSES ? SharedClassBytes(b->cls) - BLOCK_HEADER : 0;
+}
+
+size_t SharedPool::carvedBytes() const
+{
+    return segment()->top.load(std::memory_order_relaxed) - SharedFirstBlock(bytes);
+}
+
+size_t SharedPool::buffers() const
+{
+    return segment()->buffers.load(std::memory_order_relaxed);
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static thread_local Arena* t_arena = 0;
+
+Arena::Arena(size_t chunk_size)
+    : top(0), end(0), chunks(0), buffer(0), bufferSize(0),
+      chunkSize(chunk_size), firstChunkSize(chunk_size), held(0)
+{
+}
+
+Arena::Arena(void *buffer, size_t size, size_t chunk_size)
+    : top((char*)buffer), end((char*)buffer + size), chunks(0), buffer((char*)buffer), bufferSize(size),
+      chunkSize(chunk_size), firstChunkSize(chunk_size), held(0)
+{
+}
+
+Arena::~Arena()
+{
+    reset();
+    if(t_arena == this) t_arena = 0;
+}
+
+void *Arena::grow(size_t n, size_t alignment)
+{
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0) return 0;
+
+    size_t need = sizeof(Chunk) + n + alignment;
+    if(need < n) return 0;
+    size_t size = std::max(chunkSize, need);
+
+    Chunk* chunk = (Chunk*)Alloc::allocate(size);
+    if(chunk == 0) return 0;
+    chunk->prev = chunks;
+    chunk->size = size;
+    chunks = chunk;
+    held += size;
+    chunkSize = std::min(chunkSize * 2, std::max((size_t)MAX_CHUNK_SIZE, firstChunkSize));
+
+    top = (char*)(chunk + 1);
+    end = (char*)chunk + size;
+    return allocate(n, alignment);
+}
+
+void Arena::rewind(const Marker &marker)
+{
+    while(chunks != marker.chunk) {
+        Chunk* chunk = chunks;
+        chunks = chunk->prev;
+        held -= chunk->size;
+        Alloc::deallocate(chunk, chunk->size);
+    }
+
+    top = marker.top;
+    end = chunks ? (char*)chunks + chunks->size : buffer + bufferSize;
+}
+
+void Arena::reset()
+{
+    Marker start;
+    start.chunk = 0;
+    start.top = buffer;
+    rewind(start);
+    chunkSize = firstChunkSize;
+}
+
+bool Arena::owns(const void *p) const
+{
+    const char* c = (const char*)p;
+    if(c >= buffer && c < buffer + bufferSize) return true;
+    for(Chunk* chunk = chunks; chunk != 0; chunk = chunk->prev)
+        if(c >= (char*)(chunk + 1) && c < (char*)chunk + chunk->size) return true;
+    return false;
+}
+
+Arena *Arena::setCurrent(Arena *arena)
+{
+    Arena* arena_old = t_arena;
+    t_arena = arena;
+    return arena_old;
+}
+
+Arena *Arena::current()
+{
+    return t_arena;
+}
+
+/// printf into a std::string
+static void appendf(std::string& out, const char* fmt, ...)
+{
+    char buffer[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    out += buffer;
+}
+
+std::string AllocStats::toString() const
+{
+    std::string out;
+    appendf(out, "reserved %zu bytes (peak %zu), superblocks %zu bytes, "
+                 "large %zu bytes live + %zu cached, %zu os calls, %zu retries, %zu threads, "
+                 "%zu arenas, %zu remote frees\n",
+            reserved_bytes, peak_bytes, superblock_bytes,
+            large_bytes, large_cached_bytes, os_calls, retries, threads, arenas, remote_frees);
+    appendf(out, "%8s %10s %10s %12s %12s %10s %6s %10s %6s\n",
+            "size", "live", "free", "allocs", "frees", "refills", "sb", "retries", "batch");
+    for(size_t i = 0; i < classes.size(); ++i) {
+        const SizeClass& c = classes[i];
+        if(c.allocs == 0 && c.superblocks == 0) continue;
+        appendf(out, "%8zu %10zu %10zu %12zu %12zu %10zu %6zu %10zu %6zu\n",
+                c.size, c.live, c.free, c.allocs, c.frees, c.refills, c.superblocks, c.retries, c.batch);
+    }
+    return out;
+}
+
+std::string AllocStats::toJSON() const
+{
+    std::string out;
+    appendf(out, "{\"reserved_bytes\": %zu, \"peak_bytes\": %zu, \"superblock_bytes\": %zu, "
+                 "\"large_bytes\": %zu, \"large_cached_bytes\": %zu, \"os_calls\": %zu, "
+                 "\"retries\": %zu, \"threads\": %zu, \"arenas\": %zu, \"remote_frees\": %zu, \"classes\": [",
+            reserved_bytes, peak_bytes, superblock_bytes,
+            large_bytes, large_cached_bytes, os_calls, retries, threads, arenas, remote_frees);
+    for(size_t i = 0; i < classes.size(); ++i) {
+        const SizeClass& c = classes[i];
+        appendf(out, "%s{\"size\": %zu, \"live\": %zu, \"free\": %zu, \"allocs\": %zu, "
+                     "\"frees\": %zu, \"refills\": %zu, \"superblocks\": %zu, \"retries\": %zu, \"batch\": %zu}",
+                i ? ", " : "", c.size, c.live, c.free, c.allocs, c.frees, c.refills, c.superblocks, c.retries, c.batch);
+    }
+    out += "]}";
+    return out;
+}
+
+std::string BufferStats::toString() const
+{
+    std::string out;
+    appendf(out, "%zu buffers, %zu idle bytes (limit %zu), %zu evicted\n",
+            buffers, idle_bytes, limit_bytes, evicted);
+    for(size_t i = 0; i < available.size(); ++i)
+        appendf(out, "%12zu bytes: %zu available\n", available[i].first, available[i].second);
+    return out;
+}
+
+std::string BufferStats::toJSON() const
+{
+    std::string out;
+    appendf(out, "{\"buffers\": %zu, \"idle_bytes\": %zu, \"limit_bytes\": %zu, \"evicted\": %zu, \"available\": [",
+            buffers, idle_bytes, limit_bytes, evicted);
+    for(size_t i = 0; i < available.size(); ++i)
+        appendf(out, "%s{\"bytes\": %zu, \"count\": %zu}", i ? ", " : "",
+                available[i].first, available[i].second);
+    out += "]}";
+    return out;
+}
+
+/// never destroyed, a detached scavenger may still wait on it during exit
+struct ScavengerState {
+    std::mutex              mutex;
+    std::condition_variable wake;
+    int                     generation;
+};
+
+static ScavengerState& scavengerState()
+{
+    static ScavengerState* state = new ScavengerState();
+    return *state;
+}
+
+static void scavengerLoop(int generation)
+{
+    ScavengerState& st = scavengerState();
+    std::unique_lock<std::mutex> lock(st.mutex);
+
+    while(generation == st.generation) {
+        std::chrono::milliseconds interval(g_scavengeInterval);
+        if(st.wake.wait_for(lock, interval, [&]() {return generation != st.generation;}))
+            break;
+
+        // the provisioner's superblocks are not idle memory
+        size_t idle = std::max(g_scavengeIdle, g_provisionHigh * AllocImpl::Instance().arenaCount());
+        lock.unlock();
+        AllocImpl::Instance().trim(idle);
+        AllocPrime::trim(g_largeCacheLimit);
+        lock.lock();
+    }
+}
+
+int Alloc::setScavenger(int interval_ms, size_t idle_bytes)
+{
+    ScavengerState& st = scavengerState();
+    std::unique_lock<std::mutex> lock(st.mutex);
+    int interval_old = g_scavengeInterval;
+
+    g_scavengeInterval = interval_ms;
+    g_scavengeIdle = idle_bytes;
+    int generation = ++st.generation;
+    st.wake.notify_all();
+
+    if(interval_ms > 0)
+        std::thread(scavengerLoop, generation).detach();
+    return interval_old;
+}
+
+static void provisionerLoop()
+{
+    ProvisionerState& st = provisionerState();
+    std::unique_lock<std::mutex> lock(st.mutex);
+
+    for(;;) {
+        st.wake.wait(lock, [&]() {return st.requested;});
+        st.requested = false;
+
+        size_t low = g_provisionLow, high = g_provisionHigh;
+        if(low == 0)
+            continue;
+        lock.unlock();
+        AllocImpl::Instance().provision(low, high);
+        lock.lock();
+    }
+}
+
+size_t Alloc::setProvisioning(size_t low_bytes, size_t high_bytes)
+{
+    ProvisionerState& st = provisionerState();
+    std::unique_lock<std::mutex> lock(st.mutex);
+    size_t low_old = g_provisionLow;
+
+    if(high_bytes < low_bytes) high_bytes = 2 * low_bytes;
+    g_provisionLow = low_bytes;
+    g_provisionHigh = low_bytes ? high_bytes : 0;
+    st.requested = true;                    // fill up right away
+    st.wake.notify_all();
+    bool start = low_bytes != 0 && !st.started;
+    if(start) st.started = true;
+
+    // refills take this lock under a carve lock, the new thread allocates
+    lock.unlock();
+    if(start)
+        std::thread(provisionerLoop).detach();
+    return low_old;
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+size_t Alloc::setSampling(size_t interval_bytes)
+{
+    if(interval_bytes != 0)
+        HeapProfiler::start();
+    return g_sampleInterval.exchange(interval_bytes);
+}
+
+/// the sampled counts of one stack
+/// the counts of a stack as they were under the lock, its frames never change
+struct ProfileEntry {
+    HeapProfiler::Stack* stack;
+    uint64_t  live;
+    uint64_t  live_bytes;
+    double    live_weight;
+    uint64_t  allocs;
+    uint64_t  alloc_bytes;
+    double    alloc_weight;
+};
+
+/// the name of the function a return address is in, for folded stacks
+static std::string Symbolize(void* pc)
+{
+    Dl_info info;
+    if(dladdr((char*)pc - 1, &info) != 0 && info.dli_sname != 0) {
+        int status = 0;
+        char* name = abi::__cxa_demangle(info.dli_sname, 0, 0, &status);
+        std::string result = status == 0 ? name : info.dli_sname;
+        free(name);
+        return result;
+    }
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%p", pc);
+    return buffer;
+}
+
+std::string Alloc::profile(ProfileFormat format)
+{
+    std::string out;
+    HeapProfiler::Live* table = HeapProfiler::live.load(std::memory_order_acquire);
+    if(table == 0) return out;
+    HeapProfiler::Stack* stacks = HeapProfiler::stacks.load(std::memory_order_relaxed);
+
+    bool inProfiler = t_inProfiler;
+    t_inProfiler = true;
+
+    // copy the counts out under the lock, format them after
+    std::vector<ProfileEntry> entries;
+    {
+        std::unordered_map<HeapProfiler::Stack*, size_t> index;
+        std::unique_lock<std::mutex> lock(HeapProfiler::mutex);
+        for(size_t i = 0; i < (size_t)HeapProfiler::STACKS; ++i) {
+            HeapProfiler::Stack* s = &stacks[i];
+            if(s->hash == 0) continue;
+            ProfileEntry e = {s, 0, 0, 0, s->allocs, s->alloc_bytes, s->alloc_weight};
+            index[s] = entries.size();
+            entries.push_back(e);
+        }
+        for(size_t i = 0; i < (size_t)HeapProfiler::LIVE; ++i) {
+            HeapProfiler::Live& l = table[i];
+            if(l.ptr.load(std::memory_order_relaxed) <= (uintptr_t)HeapProfiler::TOMBSTONE) continue;
+            ProfileEntry& e = entries[index[l.stack]];
+            ++e.live;
+            e.live_bytes += l.size;
+            e.live_weight += l.weight;
+        }
+    }
+
+    if(format == PROFILE_PPROF) {
+        uint64_t live = 0, live_bytes = 0, allocs = 0, alloc_bytes = 0;
+        for(size_t i = 0; i < entries.size(); ++i) {
+            live += entries[i].live;
+            live_bytes += entries[i].live_bytes;
+            allocs += entries[i].allocs;
+            alloc_bytes += entries[i].alloc_bytes;
+        }
+        appendf(out, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+                (unsigned long long)live, (unsigned long long)live_bytes,
+                (unsigned long long)allocs, (unsigned long long)alloc_bytes,
+                g_sampleInterval.load(std::memory_order_relaxed));
+
+        for(size_t i = 0; i < entries.size(); ++i) {
+            const ProfileEntry& e = entries[i];
+            appendf(out, "%8llu: %8llu [%8llu: %8llu] @",
+                    (unsigned long long)e.live, (unsigned long long)e.live_bytes,
+                    (unsigned long long)e.allocs, (unsigned long long)e.alloc_bytes);
+            for(int d = 0; d < e.stack->depth; ++d)
+                appendf(out, " %p", e.stack->pcs[d]);
+            out += "\n";
+        }
+
+        // pprof maps the addresses to symbols with the mappings of the process
+        out += "\nMAPPED_LIBRARIES:\n";
+        if(FILE* maps = fopen("/proc/self/maps", "r")) {
+            char buffer[4096];
+            size_t n;
+            while((n = fread(buffer, 1, sizeof(buffer), maps)) > 0)
+                out.append(buffer, n);
+            fclose(maps);
+        }
+    } else {
+        // outermost frame first, the value is the bytes the samples stand for
+        std::unordered_map<void*, std::string> names;
+        for(size_t i = 0; i < entries.size(); ++i) {
+            const ProfileEntry& e = entries[i];
+            double bytes = format == PROFILE_FOLDED_LIVE ? e.live_weight : e.alloc_weight;
+            if(bytes < 1) continue;
+
+            for(int d = e.stack->depth - 1; d >= 0; --d) {
+                std::string& name = names[e.stack->pcs[d]];
+                if(name.empty()) name = Symbolize(e.stack->pcs[d]);
+                out += name;
+                out += d ? ";" : "";
+            }
+            appendf(out, " %.0f\n", bytes);
+        }
+    }
+
+    t_inProfiler = inProfiler;
+    return out;
+}
+
+bool Alloc::dumpProfile(const char *path, ProfileFormat format)
+{
+    std::string text = profile(format);
+    FILE* f = fopen(path, "w");
+    if(f == 0) return false;
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    return fclose(f) == 0 && ok;
+}
+
+/// never destroyed, the dumping thread waits on the pipe until the process exits
+struct ProfileSignalState {
+    std::mutex   mutex;
+    int          signo;
+    std::string  prefix;
+    int          dumps;
+    int          pipe[2];
+};
+
+static ProfileSignalState& profileSignalState()
+{
+    static ProfileSignalState* state = new ProfileSignalState();
+    return *state;
+}
+
+static volatile int g_profilePipe = -1;
+
+/// only wakes the dumping thread, nothing else is safe in a signal handler
+static void profileSignalHandler(int)
+{
+    int saved = errno;
+    char c = 1;
+    if(write(g_profilePipe, &c, 1) < 0) {}
+    errno = saved;
+}
+
+static void profileDumpLoop(int fd)
+{
+    ProfileSignalState& st = profileSignalState();
+    char c;
+    for(;;) {
+        ssize_t n = read(fd, &c, 1);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return;
+
+        std::unique_lock<std::mutex> lock(st.mutex);
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.%d.%04d.heap", st.prefix.c_str(), (int)getpid(), st.dumps++);
+        lock.unlock();
+        if(!Alloc::dumpProfile(path))
+            fprintf(stderr, "can not write the heap profile %s\n", path);
+    }
+}
+
+int Alloc::setProfileSignal(int signo, const char *prefix)
+{
+    ProfileSignalState& st = profileSignalState();
+    std::unique_lock<std::mutex> lock(st.mutex);
+    int signo_old = st.signo;
+
+    if(signo_old != 0)
+        signal(signo_old, SIG_DFL);
+    st.signo = 0;
+    if(signo == 0)
+        return signo_old;
+
+    if(g_profilePipe < 0) {
+        if(pipe(st.pipe) != 0)
+            return signo_old;
+        g_profilePipe = st.pipe[1];
+        std::thread(profileDumpLoop, st.pipe[0]).detach();
+    }
+
+    st.prefix = prefix ? prefix : "pi";
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profileSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(signo, &action, 0) == 0)
+        st.signo = signo;
+    return signo_old;
+}
+
 } // end of namespace pi
 
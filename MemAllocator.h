@@ -17,18 +17,89 @@
 #ifndef MEMALLOCATOR_H
 #define MEMALLOCATOR_H
 
+#include <algorithm>
+#include <atomic>
 #include <mutex>
 #include <thread>
 
 #include <unordered_map>
 #include <deque>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <iostream>
 #include <new>
+#include <limits>
+#include <memory>
+#include <type_traits>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define PI_HAS_MEMORY_RESOURCE 1
+#endif
+#endif
 
 namespace pi {
 
 
+/////////////////////////////////////////////////////////////
+/// \brief a snapshot of the state of Alloc, see Alloc::stats()
+/////////////////////////////////////////////////////////////
+struct AllocStats {
+    struct SizeClass {
+        size_t size;            ///< object size of the class
+        size_t live;            ///< objects handed out and not yet freed
+        size_t free;            ///< carved objects waiting in a free list or thread cache
+        size_t allocs;          ///< allocations served
+        size_t frees;           ///< deallocations
+        size_t refills;         ///< batches a thread cache fetched from the shared list
+        size_t superblocks;     ///< superblocks owned by the class
+        size_t retries;         ///< failed CAS on the shared list or waits on the carve lock
+        size_t batch;           ///< objects a refill moves: the fixed batch, else the largest adaptive one of the threads
+    };
+
+    std::vector<SizeClass> classes;
+
+    size_t reserved_bytes;      ///< bytes currently held from the OS
+    size_t peak_bytes;          ///< high-water mark of reserved_bytes
+    size_t superblock_bytes;    ///< bytes mapped for superblocks
+    size_t large_bytes;         ///< bytes of live large allocations
+    size_t large_cached_bytes;  ///< bytes of freed large spans kept for reuse
+    size_t os_calls;            ///< mmap/munmap/mremap/madvise calls
+    size_t retries;             ///< sum of the per class retries
+    size_t threads;             ///< threads with an active cache
+    size_t arenas;              ///< NUMA node arenas in use
+    size_t remote_frees;        ///< objects freed on another node than their arena's
+
+    std::string toString() const;
+    std::string toJSON() const;
+};
+
+/////////////////////////////////////////////////////////////
+/// \brief a snapshot of a MemAllocator, see MemAllocator::stats()
+/////////////////////////////////////////////////////////////
+struct BufferStats {
+    size_t buffers;                                     ///< buffers created by getBuffer and not released
+    size_t idle_bytes;                                  ///< bytes of the buffers waiting for reuse
+    size_t limit_bytes;                                 ///< high watermark of the waiting buffers
+    size_t evicted;                                     ///< buffers freed to stay within the limits
+    std::vector<std::pair<size_t, size_t> > available;  ///< (size, buffers waiting for reuse)
+
+    std::string toString() const;
+    std::string toJSON() const;
+};
+
+
+/// what Alloc::profile() reports
+enum ProfileFormat {
+    PROFILE_PPROF,                          ///< live and allocated counts per stack, for pprof (heap_v2)
+    PROFILE_FOLDED_LIVE,                    ///< estimated live bytes per stack, folded for flame graphs
+    PROFILE_FOLDED_ALLOCATED                ///< estimated allocated bytes per stack since sampling started
+};
+
 /////////////////////////////////////////////////////////////
 /// \brief when you need some memory, please use this class
 /////////////////////////////////////////////////////////////
@@ -49,14 +120,86 @@ public:
     static void  deallocate(void* p, size_t n);
 
     /**
-     * @brief reallocate some memory to your pointer
-     * @param pointer
+     * @brief reallocate some memory to your pointer, keeping its contents. a new
+     *        size of the same size class returns the same pointer, large blocks
+     *        are remapped rather than copied
+     * @param pointer (0 allocates)
      * @param old size
      * @param new size
-     * @return the pointer to the new memory
+     * @return the pointer to the new memory, the first min(old, new) bytes as before
      */
     static void* reallocate(void*p, size_t old_sz, size_t new_sz);
 
+    /**
+     * @brief allocate memory aligned to alignment. alignments up to 64 bytes are
+     *        served from the size classes, larger ones from page aligned spans
+     * @param memory size you need
+     * @param a power of two up to the page size
+     * @return pointer to the memory, 0 for an unsupported alignment
+     */
+    static void* allocate_aligned(size_t n, size_t alignment);
+
+    /**
+     * @brief deallocate memory from allocate_aligned
+     * @param pointer to the memory
+     * @param the size and the alignment it was allocated with
+     *
+     * @note the unsized deallocate(p) frees it as well
+     */
+    static void  deallocate_aligned(void* p, size_t n, size_t alignment);
+
+    /**
+     * @brief deallocate memory without telling its size, the size class
+     *        is found in a page map
+     * @param pointer returned by allocate or reallocate (0 is ignored)
+     */
+    static void  deallocate(void* p);
+
+    /**
+     * @brief allocate count blocks of n bytes at once. the thread cache is used up
+     *        first, then the run still needed is detached from the shared free
+     *        list with one CAS and the remainder is carved in one piece
+     * @param memory size of every block
+     * @param blocks you need
+     * @param receives the pointers
+     * @return blocks stored to out, less than count only when large blocks run out
+     */
+    static size_t allocate_batch(size_t n, size_t count, void** out);
+
+    /**
+     * @brief deallocate count blocks of n bytes, handed back to the shared free
+     *        list in one piece
+     * @param pointers to the blocks
+     * @param number of blocks
+     * @param the size of every block
+     */
+    static void  deallocate_batch(void** ptrs, size_t count, size_t n);
+
+    /**
+     * @brief the bytes usable in a block, at least the size it was allocated with
+     * @param pointer returned by allocate or reallocate
+     * @return the usable size, 0 for a pointer which is not from Alloc
+     */
+    static size_t usable_size(void* p);
+
+    /**
+     * @brief reallocate without telling the old size
+     * @param pointer
+     * @param new size
+     * @return the pointer to the new memory
+     */
+    static void* reallocate(void* p, size_t new_sz);
+
+    /**
+     * @brief allocate, allocate_aligned and reallocate which report running out of memory.
+     *        when the OS refuses memory and no oom handler is set, they return 0 (a failed
+     *        try_reallocate leaves the old block as it was) where the others end the process
+     * @return the pointer to the memory, 0 when none could be had
+     */
+    static void* try_allocate(size_t n);
+    static void* try_allocate_aligned(size_t n, size_t alignment);
+    static void* try_reallocate(void* p, size_t new_sz);
+
     /**
      * @brief set a function to deal with the condition that the physical memory is not adequate
      * @param the function pointer whose format is void(*)()
@@ -64,12 +207,665 @@ public:
      */
     static void (*set_oom_malloc_handler(void (*f)())) ();
 
+    /**
+     * @brief give idle memory back to the OS. the calling thread's cache is flushed
+     *        (a thread without one gets none), superblocks whose objects are all free are released and the cache of
+     *        freed large spans is emptied
+     * @param bytes of free superblocks which may stay resident for quick reuse
+     * @return the bytes returned to the OS
+     */
+    static size_t trim(size_t keep_bytes = 0);
+
+    /**
+     * @brief start a background thread which trims the pool periodically
+     * @param milliseconds between two trims, 0 stops the scavenger
+     * @param bytes of free superblocks the scavenger leaves resident (the idle memory target)
+     * @return the old interval
+     */
+    static int setScavenger(int interval_ms, size_t idle_bytes = 0);
+
+    /**
+     * @brief keep free superblocks mapped and prefaulted ahead of demand, so a refill
+     *        never waits for mmap or page faults. once the resident free superblocks of
+     *        an arena fall below low_bytes, a background thread tops them up to high_bytes.
+     *        the scavenger leaves at least high_bytes per arena resident. the thread
+     *        starts with the first call that turns provisioning on, later calls only
+     *        move the watermarks
+     * @param low watermark in bytes per arena, 0 stops the provisioning
+     * @param high watermark in bytes per arena, 0 for twice the low one
+     * @return the old low watermark
+     */
+    static size_t setProvisioning(size_t low_bytes, size_t high_bytes = 0);
+
+    /**
+     * @brief collect the counters of the pool, the hot paths only update
+     *        counters of their own thread, they are summed up here
+     * @return a snapshot, print it with toString() or toJSON()
+     */
+    static AllocStats stats();
+
 
-    static int setDefaultNodeNum(int nn);
+    /**
+     * @brief fix the number of objects a thread cache moves per refill or flush. by default
+     *        every class adapts its batch: it doubles on repeated refills up to 32 KB worth
+     *        of objects (at most 256) and halves while the class sits idle
+     * @param objects per batch, 0 lets the class adapt again
+     * @param bytes picks the size class to set, 0 sets every class
+     * @return the old setting of that class, or of every class
+     */
+    static int setDefaultNodeNum(int nn, size_t bytes = 0);
     static int setInitPoolSize(int ps);
+
+    /**
+     * @brief allocations above the pooled limit (32 KB) are page spans mapped with mmap.
+     *        freed spans are cached by size and reused, this sets how many bytes
+     *        of freed spans may stay cached (default 64 MB)
+     * @param the byte cap of the large span cache
+     * @return the old cap
+     */
+    static size_t setLargeCacheLimit(size_t bytes);
+
+    /**
+     * @brief set how long a freed large span stays cached before it is unmapped
+     * @param milliseconds (default 10000)
+     * @return the old decay time
+     */
+    static int setLargeCacheDecay(int ms);
+
+    /**
+     * @brief map large spans of 2 MB or more 2 MB aligned and advise transparent huge pages
+     * @param enable or disable (default disabled)
+     * @return the old setting
+     */
+    static bool setHugePage(bool enable);
+
+    /**
+     * @brief the pool keeps one arena per NUMA node; a thread refills from the arena of
+     *        the node it runs on and frees go back to the arena that owns the memory.
+     *        this simulates a topology for testing: threads are spread round-robin over
+     *        the simulated nodes in the order they first allocate, nothing is bound
+     * @param nodes to simulate, 1 for a single arena, 0 for the real topology (default)
+     * @return the old number of nodes
+     */
+    static int setNumaNodes(int nodes);
+
+    /**
+     * @brief sample about one allocation per interval bytes and keep its stack, to see
+     *        which call sites grow the pool. the distance to the next sample is drawn at
+     *        random per thread, so large and small allocations are sampled fairly.
+     *        MemAllocator buffers are sampled where getBuffer creates them
+     * @param mean bytes between two samples, e.g. 512 KB; 0 stops sampling (default)
+     * @return the old interval
+     *
+     * @note sampling off costs a thread local counter per allocation and a load per free
+     */
+    static size_t setSampling(size_t interval_bytes);
+
+    /**
+     * @brief the sampled heap profile
+     * @param which profile and in which format
+     * @return the profile, empty before sampling was ever started
+     */
+    static std::string profile(ProfileFormat format = PROFILE_PPROF);
+
+    /**
+     * @brief write profile(format) to a file
+     * @return false if the file can not be written
+     */
+    static bool dumpProfile(const char* path, ProfileFormat format = PROFILE_PPROF);
+
+    /**
+     * @brief dump the pprof profile to <prefix>.<pid>.<n>.heap whenever the process
+     *        receives signo, e.g. kill -USR2 <pid>
+     * @param the signal, 0 stops listening
+     * @param the path prefix of the dumps, 0 for the default "pi"
+     * @return the old signal
+     */
+    static int setProfileSignal(int signo, const char* prefix = "pi");
 };
 
 
+class AllocImpl;
+
+/////////////////////////////////////////////////////////////
+/// \brief a heap of its own: size classes, superblocks, thread
+///        caches and settings apart from Alloc (the default heap),
+///        so a subsystem does not mix its free lists with the rest
+///        of the program. destroying the heap gives everything it
+///        holds back to the OS at once
+///
+/// @example pi::Heap frames;
+///          void* p = frames.allocate(640);
+///          ...                             // no need to free p one by one
+///
+/// @note memory of a heap must be freed through that heap, and no
+///       thread may use a heap while it is destroyed
+/////////////////////////////////////////////////////////////
+class Heap {
+public:
+    /**
+     * @brief create a heap
+     * @param objects a thread cache moves per refill, 0 adapts (see Alloc::setDefaultNodeNum)
+     * @param bytes of superblocks mapped up front
+     */
+    explicit Heap(int node_num = 0, int init_pool_size = 0);
+    ~Heap();
+
+    void*  allocate(size_t n);
+    void   deallocate(void* p, size_t n);
+    void   deallocate(void* p);
+    void*  reallocate(void* p, size_t old_sz, size_t new_sz);
+    void*  allocate_aligned(size_t n, size_t alignment);
+    void   deallocate_aligned(void* p, size_t n, size_t alignment);
+    size_t allocate_batch(size_t n, size_t count, void** out);
+    void   deallocate_batch(void** ptrs, size_t count, size_t n);
+    size_t usable_size(void* p);
+
+    /**
+     * @brief give idle superblocks of this heap back to the OS, see Alloc::trim
+     */
+    size_t trim(size_t keep_bytes = 0);
+
+    /**
+     * @brief the counters of this heap; the OS counters are process wide
+     */
+    AllocStats stats();
+
+    int setNodeNum(int nn, size_t bytes = 0);
+
+private:
+    Heap(const Heap&);
+    Heap& operator=(const Heap&);
+
+    AllocImpl* impl;
+};
+
+
+/////////////////////////////////////////////////////////////
+/// \brief a pool in a shared memory segment (shm_open or memfd)
+///        which several processes map, so large buffers move between
+///        them without a copy. a buffer is named by a Handle, its
+///        offset in the segment, which each process resolves against
+///        its own mapping address. the free lists link blocks by
+///        offset too and are lock-free, so a process that dies while
+///        using the pool leaves no lock behind
+///
+/// @example pi::SharedPool* pool = pi::SharedPool::create("/frames", 256 << 20);
+///          pi::SharedPool::Handle h = pool->getBuffer(1920 * 1080 * 3);
+///          capture(pool->resolve(h));
+///          send(socket, &h, sizeof(h));     // the other process opens "/frames",
+///                                           // resolves h and returns the buffer
+///
+/// @note buffers are never split or merged: a freed buffer serves its
+///       size class again, the segment only grows into its free end
+/////////////////////////////////////////////////////////////
+class SharedPool {
+public:
+    typedef uint64_t Handle;                ///< 0 is no buffer
+
+    /**
+     * @brief create a segment and its pool
+     * @param name for shm_open ("/name"), 0 for an anonymous memfd, see fd()
+     * @param bytes of the segment
+     * @return the pool, 0 when the segment can not be created (errno tells why)
+     */
+    static SharedPool* create(const char* name, size_t bytes);
+
+    /**
+     * @brief map the pool another process created under name
+     * @return the pool, 0 when there is none
+     */
+    static SharedPool* open(const char* name);
+
+    /**
+     * @brief map the pool behind a descriptor, e.g. the fd() of a memfd pool
+     *        inherited through fork() or received over a unix socket
+     * @return the pool, 0 when fd holds none; the descriptor is duplicated
+     */
+    static SharedPool* open(int fd);
+
+    /**
+     * @brief remove the name of a segment, processes which mapped it keep it
+     */
+    static bool remove(const char* name);
+
+    /// unmaps the segment, the buffers stay with the other processes
+    ~SharedPool();
+
+    /**
+     * @brief get a buffer of at least bytes, 64 byte aligned
+     * @return its handle, 0 when the segment is full
+     */
+    Handle getBuffer(size_t bytes);
+
+    /**
+     * @brief give a buffer back, from any process which maps the pool.
+     *        a handle which is no buffer or already returned is ignored
+     */
+    void   returnBuffer(Handle handle);
+
+    /// the buffer in this process' mapping, 0 for a handle which is no buffer of the pool
+    void*  resolve(Handle handle) const;
+
+    /// the handle of a buffer resolved in this process
+    Handle handleOf(const void* buffer) const;
+
+    /// the bytes a buffer may hold
+    size_t bufferSize(Handle handle) const;
+
+    int    fd() const { return file; }
+    size_t size() const { return bytes; }
+    size_t carvedBytes() const;             ///< bytes of the segment carved into buffers
+    size_t buffers() const;                 ///< buffers handed out and not returned
+
+private:
+    struct Segment;
+
+    SharedPool(int file, char* base, size_t bytes);
+    SharedPool(const SharedPool&);
+    SharedPool& operator=(const SharedPool&);
+
+    static SharedPool* map(int file, bool init);
+    Segment* segment() const { return (Segment*)base; }
+
+    int     file;
+    char*   base;
+    size_t  bytes;
+};
+
+
+/////////////////////////////////////////////////////////////
+/// \brief a bump pointer arena for memory that dies together,
+///        e.g. everything one frame or one request allocates.
+///        allocation bumps a pointer through chunks taken from
+///        Alloc, deallocation does nothing but undo the latest
+///        allocation, and reset() gives all chunks back at once
+///
+/// @example pi::InlineArena<4096> frame;     // the first 4KB live on the stack
+///          for(...) {
+///              Obj* o = new(frame.allocate(sizeof(Obj), alignof(Obj))) Obj;
+///              ...
+///              frame.reset();
+///          }
+///
+/// @note an arena belongs to one thread and never runs destructors
+/////////////////////////////////////////////////////////////
+class Arena {
+public:
+    enum {
+        CHUNK_SIZE = 32768,                  ///< the first chunk, later ones double
+        MAX_CHUNK_SIZE = 1 << 20
+    };
+
+    /// where the arena stood, see mark() and rewind()
+    struct Marker {
+        void*  chunk;
+        char*  top;
+    };
+
+    /////////////////////////////////////////////////////
+    /// \brief rewinds the arena to where it stood when the
+    ///        scope was entered
+    ////////////////////////////////////////////////////
+    class Scope {
+    public:
+        explicit Scope(Arena& arena) : arena(arena), marker(arena.mark()) {}
+        ~Scope() { arena.rewind(marker); }
+
+    private:
+        Scope(const Scope&);
+        Scope& operator=(const Scope&);
+
+        Arena&  arena;
+        Marker  marker;
+    };
+
+    /**
+     * @brief an arena that starts with an empty chunk list
+     * @param bytes of the first chunk
+     */
+    explicit Arena(size_t chunk_size = CHUNK_SIZE);
+
+    /**
+     * @brief an arena that serves from buffer before it takes any chunk
+     * @param the first buffer, the arena never frees it
+     * @param bytes of the buffer
+     * @param bytes of the first chunk
+     */
+    Arena(void* buffer, size_t size, size_t chunk_size = CHUNK_SIZE);
+    ~Arena();
+
+    /**
+     * @brief allocate some memory
+     * @param memory size you need, 0 takes one byte so that every call
+     *        returns a distinct pointer, whatever the arena holds
+     * @param a power of two
+     * @return pointer to the memory, 0 when no chunk could be had
+     */
+    void* allocate(size_t n, size_t alignment = sizeof(void*)) {
+        if(n == 0) n = 1;
+        char* p = (char*)(((uintptr_t)top + alignment - 1) & ~(uintptr_t)(alignment - 1));
+        if(p >= top && p <= end && n <= (size_t)(end - p)) {
+            top = p + n;
+            return p;
+        }
+        return grow(n, alignment);
+    }
+
+    /**
+     * @brief gives the memory back only if it is the latest allocation,
+     *        anything else waits for rewind() or reset()
+     */
+    void deallocate(void* p, size_t n) {
+        if(n == 0) n = 1;
+        if((char*)p + n == top)
+            top = (char*)p;
+    }
+
+    Marker mark() const {
+        Marker m;
+        m.chunk = chunks;
+        m.top = top;
+        return m;
+    }
+
+    /**
+     * @brief free everything allocated after the marker was taken and
+     *        give the chunks taken since back to Alloc
+     */
+    void rewind(const Marker& marker);
+
+    /**
+     * @brief free everything, in O(chunks)
+     */
+    void reset();
+
+    bool owns(const void* p) const;
+
+    /**
+     * @brief bytes of the chunks the arena holds, without the first buffer
+     */
+    size_t chunkBytes() const { return held; }
+
+    /**
+     * @brief the arena ArenaAlloc draws from on the calling thread
+     * @param the arena, 0 for none
+     * @return the old one
+     */
+    static Arena* setCurrent(Arena* arena);
+    static Arena* current();
+
+private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    struct Chunk {
+        Chunk*  prev;
+        size_t  size;                       ///< bytes including this header
+    };
+
+    void* grow(size_t n, size_t alignment);
+
+    char*   top;                            ///< next free byte
+    char*   end;                            ///< end of the buffer or chunk top points into
+    Chunk*  chunks;                         ///< latest chunk, 0 while in the first buffer
+    char*   buffer;
+    size_t  bufferSize;
+    size_t  chunkSize;                      ///< bytes of the next chunk
+    size_t  firstChunkSize;
+    size_t  held;
+};
+
+/////////////////////////////////////////////////////////////
+/// \brief an arena whose first N bytes are part of the object,
+///        so an arena on the stack takes no chunk at all until
+///        it outgrows them
+/////////////////////////////////////////////////////////////
+template <size_t N>
+class InlineArena : public Arena {
+public:
+    explicit InlineArena(size_t chunk_size = CHUNK_SIZE) : Arena(storage, N, chunk_size) {}
+
+private:
+    alignas(16) char storage[N];
+};
+
+/////////////////////////////////////////////////////////////
+/// \brief an _Allocator policy over the current arena of the
+///        calling thread (see Arena::setCurrent), and over Alloc
+///        when the thread has none
+///
+/// @example pi::Arena frame;
+///          pi::Arena::setCurrent(&frame);
+///          pi::MemAllocator<Item, pi::ArenaAlloc>& items =
+///              pi::MemAllocator<Item, pi::ArenaAlloc>::Instance();
+///          ...
+///          items.releaseBuffers();        // before the arena lets go of them
+///          frame.reset();
+///
+/// @note memory must be freed while the arena it came from is current
+/////////////////////////////////////////////////////////////
+struct ArenaAlloc {
+    static void* allocate(size_t n) {
+        return allocate_aligned(n, sizeof(void*));
+    }
+
+    static void deallocate(void* p, size_t n) {
+        deallocate_aligned(p, n, sizeof(void*));
+    }
+
+    static void* allocate_aligned(size_t n, size_t alignment) {
+        Arena* arena = Arena::current();
+        if(arena == 0) return Alloc::allocate_aligned(n, alignment);
+        if(alignment == 0 || (alignment & (alignment - 1)) != 0) return 0;
+        return arena->allocate(n, alignment);
+    }
+
+    static void deallocate_aligned(void* p, size_t n, size_t alignment) {
+        Arena* arena = Arena::current();
+        if(arena != 0 && arena->owns(p)) arena->deallocate(p, n);
+        else Alloc::deallocate_aligned(p, n, alignment);
+    }
+};
+
+
+
+/////////////////////////////////////////////////////////////
+/// \brief a standard allocator over Alloc, so node based
+///        containers take their nodes from the pool size classes
+///
+/// @example std::map<int, Data, std::less<int>,
+///                   pi::PoolAllocator<std::pair<const int, Data> > > m;
+///
+/// @note it is stateless, every PoolAllocator compares equal
+/////////////////////////////////////////////////////////////
+template <typename T>
+class PoolAllocator {
+public:
+    typedef T               value_type;
+    typedef T*              pointer;
+    typedef const T*        const_pointer;
+    typedef T&              reference;
+    typedef const T&        const_reference;
+    typedef size_t          size_type;
+    typedef std::ptrdiff_t  difference_type;
+
+    typedef std::false_type propagate_on_container_copy_assignment;
+    typedef std::true_type  propagate_on_container_move_assignment;
+    typedef std::false_type propagate_on_container_swap;
+    typedef std::true_type  is_always_equal;
+
+    template <typename U>
+    struct rebind {
+        typedef PoolAllocator<U> other;
+    };
+
+    PoolAllocator() noexcept {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if(n > max_size()) throw std::bad_alloc();
+        void* p = Alloc::allocate_aligned(n * sizeof(T), alignof(T));
+        if(p == 0) throw std::bad_alloc();
+        return (T*)p;
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        Alloc::deallocate_aligned(p, n * sizeof(T), alignof(T));
+    }
+
+    size_t max_size() const noexcept {
+        return std::numeric_limits<size_t>::max() / sizeof(T);
+    }
+};
+
+template <typename T, typename U>
+inline bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) noexcept { return true; }
+
+template <typename T, typename U>
+inline bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) noexcept { return false; }
+
+
+/////////////////////////////////////////////////////////////
+/// \brief a standard allocator over an Arena, for containers
+///        that are thrown away with the arena
+///
+/// @example pi::InlineArena<8192> frame;
+///          std::vector<int, pi::ArenaAllocator<int> > v(pi::ArenaAllocator<int>(frame));
+/////////////////////////////////////////////////////////////
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T               value_type;
+    typedef T*              pointer;
+    typedef const T*        const_pointer;
+    typedef T&              reference;
+    typedef const T&        const_reference;
+    typedef size_t          size_type;
+    typedef std::ptrdiff_t  difference_type;
+
+    typedef std::true_type  propagate_on_container_copy_assignment;
+    typedef std::true_type  propagate_on_container_move_assignment;
+    typedef std::true_type  propagate_on_container_swap;
+    typedef std::false_type is_always_equal;
+
+    template <typename U>
+    struct rebind {
+        typedef ArenaAllocator<U> other;
+    };
+
+    explicit ArenaAllocator(Arena& arena) noexcept : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena(other.getArena()) {}
+
+    T* allocate(size_t n) {
+        if(n > max_size()) throw std::bad_alloc();
+        void* p = arena->allocate(n * sizeof(T), alignof(T));
+        if(p == 0) throw std::bad_alloc();
+        return (T*)p;
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        arena->deallocate(p, n * sizeof(T));
+    }
+
+    size_t max_size() const noexcept {
+        return std::numeric_limits<size_t>::max() / sizeof(T);
+    }
+
+    Arena* getArena() const noexcept { return arena; }
+
+private:
+    Arena* arena;
+};
+
+template <typename T, typename U>
+inline bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) noexcept { return a.getArena() == b.getArena(); }
+
+template <typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) noexcept { return a.getArena() != b.getArena(); }
+
+
+/////////////////////////////////////////////////////////////
+/// \brief the deleter of pooled_ptr: destroys the object and
+///        gives its storage back to the size class of T
+///
+/// @note it does not convert from the deleter of a derived
+///       class, whose objects live in another size class
+/////////////////////////////////////////////////////////////
+template <typename T>
+struct PooledDeleter {
+    void operator()(T* p) const noexcept {
+        p->~T();
+        Alloc::deallocate_aligned((void*)p, sizeof(T), alignof(T));
+    }
+};
+
+/// an owning pointer to an object allocated by make_pooled
+template <typename T>
+using pooled_ptr = std::unique_ptr<T, PooledDeleter<T> >;
+
+/**
+ * @brief construct a T in memory from Alloc, freed again by the pooled_ptr
+ * @param arguments of the constructor of T
+ * @return the object, the memory is given back if the constructor throws
+ */
+template <typename T, typename... Args>
+pooled_ptr<T> make_pooled(Args&&... args)
+{
+    void* p = Alloc::allocate_aligned(sizeof(T), alignof(T));
+    if(p == 0) throw std::bad_alloc();
+    try {
+        return pooled_ptr<T>(new(p) T(std::forward<Args>(args)...));
+    } catch(...) {
+        Alloc::deallocate_aligned(p, sizeof(T), alignof(T));
+        throw;
+    }
+}
+
+/**
+ * @brief std::allocate_shared over PoolAllocator, the object and the control
+ *        block share one allocation from Alloc
+ * @param arguments of the constructor of T
+ */
+template <typename T, typename... Args>
+std::shared_ptr<T> make_shared_pooled(Args&&... args)
+{
+    return std::allocate_shared<T>(PoolAllocator<T>(), std::forward<Args>(args)...);
+}
+
+
+#ifdef PI_HAS_MEMORY_RESOURCE
+/////////////////////////////////////////////////////////////
+/// \brief a std::pmr::memory_resource over Alloc (c++17)
+///
+/// @example std::pmr::list<int> l(pi::PoolResource::Instance());
+/////////////////////////////////////////////////////////////
+class PoolResource : public std::pmr::memory_resource {
+public:
+    static PoolResource* Instance() {
+        static PoolResource theOneAndOnly;
+        return &theOneAndOnly;
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        void* p = Alloc::allocate_aligned(bytes, alignment);
+        if(p == 0) throw std::bad_alloc();
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        Alloc::deallocate_aligned(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const PoolResource*>(&other) != 0;
+    }
+};
+#endif
+
 
 template <typename T>
 struct trait {
@@ -81,113 +877,224 @@ struct trait {
 
 
 /////////////////////////////////////////////////////////////////
-/// \brief when you need a manager to manage your memory,
-///        in order to improve some performance of your code,
-///        please use this class.
-///        there exist memory list for users to forbid allocate
-///        and deallocate memory frequently
+/// \brief the header in front of every buffer of a MemAllocator.
+///        buffers are grouped in buckets by their allocation size,
+///        eight buckets per power of two, so any waiting buffer of
+///        a bucket can serve any request of the same bucket
 /////////////////////////////////////////////////////////////////
-template <typename T, typename _Allocator = Alloc>
-class MemAllocator
+struct BufferHeader {
+    enum {
+        MAGIC = 0x4d454d41,
+        LINEAR_BUCKETS = 16,                ///< 8 bytes apart up to 128 bytes
+        STEPS = 8,
+        BUCKETS = LINEAR_BUCKETS + STEPS * 57
+    };
+
+    BufferHeader*  next;                    ///< free stack link while the buffer waits for reuse
+    uint32_t       bucket;
+    uint32_t       magic;
+    size_t         num;                     ///< objects the buffer currently holds
+    uint32_t       offset;                  ///< bytes from the allocated block to the header
+    uint32_t       align;                   ///< alignment the block was allocated with
+
+    static unsigned bucketOf(size_t bytes) {
+        if(bytes <= 128) return bytes ? (unsigned)((bytes - 1) >> 3) : 0;
+        unsigned lg = 63 - __builtin_clzll((unsigned long long)(bytes - 1));
+        size_t base = (size_t)1 << lg;
+        return LINEAR_BUCKETS + (lg - 7) * STEPS + (unsigned)((bytes - 1 - base) / (base / STEPS));
+    }
+
+    static size_t bucketBytes(unsigned bucket) {
+        if(bucket < LINEAR_BUCKETS) return (bucket + 1) * 8;
+        size_t base = (size_t)1 << (7 + (bucket - LINEAR_BUCKETS) / STEPS);
+        return base + ((bucket - LINEAR_BUCKETS) % STEPS + 1) * (base / STEPS);
+    }
+
+    /// data of a buffer aligned to alignment starts this far into its block
+    static size_t dataOffset(size_t alignment) {
+        return alignment > sizeof(BufferHeader) ? alignment : sizeof(BufferHeader);
+    }
+
+    size_t capacity() const { return bucketBytes(bucket) - offset - sizeof(BufferHeader); }
+
+    void* block() { return (char*)this - offset; }
+
+    void* data() { return this + 1; }
+
+    static BufferHeader* of(void* buffer) { return (BufferHeader*)buffer - 1; }
+};
+
+
+/// which waiting buffers a MemAllocator frees first when it is over its limit
+enum BufferEviction {
+    EVICT_LRU,                              ///< the sizes reused longest ago
+    EVICT_LFU                               ///< the sizes reused least often
+};
+
+
+/////////////////////////////////////////////////////////////////
+/// \brief the bookkeeping shared by every MemAllocator.
+///        returned buffers wait in a cache the returning thread
+///        keeps for the pool, one free stack per bucket. a cache that grows
+///        past its bound spills half a bucket to a depot, which is
+///        split in SHARDS locked shards, and a thread whose cache
+///        runs dry refills a batch from its own shard first and
+///        from the other shards next.
+///        the bytes waiting in the depot are kept below a high
+///        watermark: passing it evicts whole sizes, least recently
+///        or least frequently reused first, down to the low
+///        watermark, so hot sizes stay warm.
+///        elements are constructed unless T is trivially default
+///        constructible and destroyed unless it is trivially
+///        destructible, so plain data costs neither
+/// \param T          the element type (char for MemAllocator<void>)
+/// \param _Allocator allocates blocks with allocate_aligned and deallocate_aligned like Alloc
+/////////////////////////////////////////////////////////////////
+template <typename T, typename _Allocator>
+class BufferPool
 {
 public:
-    /**
-     * @brief you are allow to use this function to get a object to manage your memory
-     * @return the memory manager
-     */
-    static MemAllocator<T>& Instance() {
-        static MemAllocator<T> theOneAndOnly;
-        return theOneAndOnly;
-    }
+    enum {
+        SHARDS = 8,
+        CACHE_DEPTH = 16,                   ///< buffers a thread keeps per bucket
+        CACHE_BYTES = 4 << 20,              ///< bytes a thread keeps over all buckets
+        BATCH = 8,                          ///< buffers moved from the depot at once
+        DEFAULT_LIMIT = 64 << 20,
+        POOLS_CACHED = 4                    ///< pools of the same T a thread keeps caches for
+    };
 
     /**
      * @brief you can get object array you want
      * @param the number of object you should get
-     * @return the object array
-     *
-     * @example in this example you can get 12 DataType objects
-     *      DataType data* = MemAllocator<DataType>::getBuffer(12);
+     * @param the alignment of the array, a power of two up to the page size
+     * @return the object array, 0 for an unsupported alignment
      *
      * @note the object is constructed by default construct function
      */
-    T* getBuffer(size_t num) {
-        std::unique_lock<std::mutex> lock(accessMutex);
-
-        if(availableBuffers.find(num) != availableBuffers.end()) {
-            std::deque<T*>& availableBuffer = availableBuffers.at(num);
-            if(availableBuffer.empty()) {
-                void *buf = _Allocator::allocate(num * sizeof(T));
-                T* buffer = (T*)buf;
-                new(buffer)T[num];
+    T* getBuffer(size_t num, size_t alignment = alignof(T)) {
+        if(alignment < sizeof(void*)) alignment = sizeof(void*);
+        size_t offset = BufferHeader::dataOffset(alignment);
+        unsigned bucket = BufferHeader::bucketOf(num * sizeof(T) + offset);
+        ThreadBuffers* cache = heap ? 0 : threadBuffers();
+        if(cache != 0 && cache->epoch != drainEpoch.load(std::memory_order_relaxed))
+            drain(cache);
+        BufferHeader* h = cache ? cache->pop(bucket) : 0;
+        if(h == 0)
+            h = refill(cache, bucket);
 
-                bufferSizes.insert(std::make_pair(buffer, num));
-
-                return buffer;
-            }
-
-            else {
-                T *buffer = availableBuffer.back();
-                availableBuffer.pop_back();
+        // a buffer of the bucket allocated for a smaller alignment may not fit
+        if(h != 0 && (h->align < alignment || h->capacity() < num * sizeof(T))) {
+            if(cache) cache->push(h);
+            else deposit(homeShard(), bucket, h, h, 1);
+            h = 0;
+        }
 
-                return buffer;
+        if(h != 0) {
+            // a waiting buffer keeps its objects, rebuild them only when the count differs
+            if(h->num != num) {
+                destroy((T*)h->data(), h->num);
+                construct((T*)h->data(), num);
+                h->num = num;
             }
+            h->magic = BufferHeader::MAGIC;
+            return (T*)h->data();
         }
 
-        else {
-            void* buf = _Allocator::allocate(num * sizeof(T));
-            T* buffer = (T*)buf;
-            new(buffer)T[num];
+        size_t bytes = BufferHeader::bucketBytes(bucket);
+        char* block = (char*)(heap ? heap->allocate_aligned(bytes, alignment)
+                                   : _Allocator::allocate_aligned(bytes, alignment));
+        if(block == 0)
+            return 0;
+        h = (BufferHeader*)(block + offset) - 1;
+        h->offset = (uint32_t)(offset - sizeof(BufferHeader));
+        h->align = (uint32_t)alignment;
+        h->bucket = bucket;
+        h->magic = BufferHeader::MAGIC;
+        h->num = num;
+        construct((T*)h->data(), num);
+        ++buffers;
+        return (T*)h->data();
+    }
 
-            bufferSizes.insert(std::make_pair(buffer, num));
-            return buffer;
+    /**
+     * @brief get count buffers of num objects each. waiting buffers for the whole
+     *        batch are taken from the depot under one lock
+     * @param num objects of every buffer
+     * @param count buffers you need
+     * @param out receives the buffers
+     * @param alignment of the buffers, a power of two
+     * @return buffers stored to out, less than count only when memory runs out
+     */
+    size_t getBuffers(size_t num, size_t count, T** out, size_t alignment = alignof(T)) {
+        ThreadBuffers* cache = heap ? 0 : threadBuffers();
+        if(cache != 0) {
+            size_t offset = BufferHeader::dataOffset(std::max(alignment, sizeof(void*)));
+            unsigned bucket = BufferHeader::bucketOf(num * sizeof(T) + offset);
+            size_t cached = cache->depth[bucket].load(std::memory_order_relaxed);
+            if(cached < count)
+                if(BufferHeader* h = refill(cache, bucket, count - cached))
+                    cache->push(h);
         }
 
+        size_t got = 0;
+        for(; got < count; ++got)
+            if((out[got] = getBuffer(num, alignment)) == 0)
+                break;
+        return got;
     }
 
     /**
      * @brief release Buffer
      * @param the pointer to the object buffer you want to release
-     * @param the number of objects you want to release
-     *
-     * @example in this example, 12 objects get by getBuffer(12) will be release
-     *      MemAllocator<DataType>::releaseBuffer(data, 12)
+     * @param the number of objects, it is kept in the buffer header
+     *        and only remains for compatibility
      *
      * @note the function will call destruction function
      */
     void releaseBuffer(T* buffer, size_t num = 1) {
+        (void)num;
         if(buffer == 0)
             return ;
-        if(num == 1)
-            buffer->~T();
-        else {
-            for(int i = 0; i < num; ++i) {
-                buffer[i].~T();
-            }
-        }
-        if(bufferSizes.find(buffer) != bufferSizes.end()) {
-            if(accessMutex.try_lock()) {
-                bufferSizes.erase(buffer);
-                accessMutex.unlock();
-            }
-            else
-                bufferSizes.erase(buffer);
+        BufferHeader* h = BufferHeader::of(buffer);
+        if(h->magic != BufferHeader::MAGIC) {
+            printf("this buffer is not in our list!\n");
+            return;
         }
-        _Allocator::deallocate((void*)buffer, sizeof(T) * num);
+        destroy(buffer, h->num);
+        dispose(h);
     }
 
     /**
      * @brief release all the buffers in memory list(it will call destruction)
+     *
+     * @note buffers waiting in the caches of other threads are kept
+     *       until those threads exit
      */
     void releaseBuffers() {
-        std::unique_lock<std::mutex>  lock(accessMutex);
-        for(auto p = availableBuffers.begin(); p != availableBuffers.end(); ++p) {
-            for(size_t i = 0; i < p->second.size(); ++i) {
-                releaseBuffer(p->second[i], p->first);
-            }
-            p->second.clear();
+        ThreadBuffers* cache = ownCache();
+        if(cache != 0) {
+            for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b)
+                while(BufferHeader* h = cache->pop(b)) {
+                    destroy((T*)h->data(), h->num);
+                    dispose(h);
+                }
         }
 
-        availableBuffers.clear();
+        // deposits into shards already drained stay, only the bytes freed are taken off
+        for(int s = 0; s < SHARDS; ++s) {
+            Shard& shard = shards[s];
+            std::unique_lock<std::mutex>  lock(shard.mutex);
+            for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b) {
+                while(shard.available[b] != 0) {
+                    BufferHeader* h = shard.available[b];
+                    shard.available[b] = h->next;
+                    destroy((T*)h->data(), h->num);
+                    dispose(h);
+                }
+                depotBytes -= shard.depth[b].load(std::memory_order_relaxed) * BufferHeader::bucketBytes(b);
+                shard.depth[b].store(0, std::memory_order_relaxed);
+            }
+        }
     }
 
     /**
@@ -199,32 +1106,514 @@ public:
     void returnBuffer(T* buffer) {
         if(buffer == 0)
             return;
-        std::unique_lock<std::mutex> lock(accessMutex);
-        if(bufferSizes.find(buffer) == bufferSizes.end()) {
+        BufferHeader* h = BufferHeader::of(buffer);
+        if(h->magic != BufferHeader::MAGIC) {
             printf("this buffer is not in our list!\n");
             return;
         }
-        size_t size = bufferSizes.at(buffer);
-        if(availableBuffers.find(size) != availableBuffers.end()) {
-            availableBuffers.at(size).push_back(buffer);
+        h->magic = 0;
+        unsigned bucket = h->bucket;
+        if(heap != 0) {
+            deposit(homeShard(), bucket, h, h, 1);
+            return;
+        }
+
+        ThreadBuffers* cache = threadBuffers();
+        if(cache == 0) {
+            deposit(homeShard(), bucket, h, h, 1);
+            return;
+        }
+        if(cache->epoch != drainEpoch.load(std::memory_order_relaxed))
+            drain(cache);
+        cache->push(h);
+        if(cache->depth[bucket].load(std::memory_order_relaxed) > CACHE_DEPTH)
+            spill(cache, bucket, CACHE_DEPTH / 2);
+        else if(cache->bytes > cacheBytes || depotBytes + cachedBytes > highWatermark)
+            spill(cache, bucket, cache->depth[bucket].load(std::memory_order_relaxed));
+    }
+
+    /**
+     * @brief limit the bytes of the buffers waiting for reuse
+     * @param high_bytes when the waiting buffers pass it, the pool evicts
+     * @param low_bytes  the pool evicts down to it, 0 for 3/4 of high_bytes
+     * @return the old high watermark
+     *
+     * @note the buffers in the thread caches count too. every thread keeps at most
+     *       high_bytes / SHARDS for itself, when the caches together hold more than
+     *       the depot can make up for, each thread spills its cache on its next access
+     */
+    size_t setLimit(size_t high_bytes, size_t low_bytes = 0) {
+        size_t high_old = highWatermark;
+        highWatermark = high_bytes;
+        lowWatermark = low_bytes ? std::min(low_bytes, high_bytes) : high_bytes / 4 * 3;
+        cacheBytes = std::min((size_t)CACHE_BYTES, high_bytes / SHARDS);
+        if(depotBytes + cachedBytes > highWatermark)
+            evict(lowWatermark, true);
+        return high_old;
+    }
+
+    /**
+     * @brief limit the bytes waiting for reuse in each size
+     * @param bytes the limit of one size, 0 for none
+     * @return the old limit
+     */
+    size_t setBucketLimit(size_t bytes) {
+        size_t bytes_old = bucketLimit;
+        bucketLimit = bytes;
+        return bytes_old;
+    }
+
+    /**
+     * @brief choose which sizes are evicted first
+     * @return the old policy
+     */
+    BufferEviction setEviction(BufferEviction policy) {
+        BufferEviction policy_old = eviction;
+        eviction = policy;
+        return policy_old;
+    }
+
+    /**
+     * @brief free waiting buffers until at most target_bytes wait for reuse
+     * @return the bytes freed
+     *
+     * @note the cache of the calling thread goes to the depot first. when the
+     *       caches of other threads keep more than target_bytes, each of them goes
+     *       to the depot on the next access of its thread and is trimmed there
+     */
+    size_t trim(size_t target_bytes = 0) {
+        ThreadBuffers* cache = ownCache();
+        if(cache != 0) {
+            for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b)
+                if(cache->available[b] != 0)
+                    spill(cache, b, cache->depth[b].load(std::memory_order_relaxed));
+        }
+        return evict(target_bytes, true);
+    }
+
+    /**
+     * @brief buffers handed out and buffers waiting in the memory list, by size
+     */
+    BufferStats stats() {
+        size_t depth[BufferHeader::BUCKETS] = {0};
+        for(int s = 0; s < SHARDS; ++s)
+            for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b)
+                depth[b] += shards[s].depth[b].load(std::memory_order_relaxed);
+        {
+            std::unique_lock<std::mutex> lock(registryMutex);
+            for(ThreadBuffers* c = registry; c != 0; c = c->next)
+                for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b)
+                    depth[b] += c->depth[b].load(std::memory_order_relaxed);
         }
-        else {
-            std::deque<T*> availableOfSize;
-            availableOfSize.push_back(buffer);
-            availableBuffers.insert(std::make_pair(size, availableOfSize));
+
+        BufferStats st;
+        st.buffers = buffers;
+        st.idle_bytes = 0;
+        st.limit_bytes = highWatermark;
+        st.evicted = evicted;
+        for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b)
+            if(depth[b] != 0) {
+                st.available.push_back(std::make_pair(BufferHeader::bucketBytes(b) - sizeof(BufferHeader), depth[b]));
+                st.idle_bytes += depth[b] * BufferHeader::bucketBytes(b);
+            }
+        return st;
+    }
+
+protected:
+    /// a pool over a heap of its own goes without thread caches, straight to the depot
+    explicit BufferPool(Heap* heap = 0) : heap(heap), buffers(0), registry(0), threads(0), depotBytes(0), cachedBytes(0),
+        drainEpoch(0), drainTarget(0), evicted(0), ticks(0),
+        highWatermark(DEFAULT_LIMIT), lowWatermark(DEFAULT_LIMIT / 4 * 3),
+        bucketLimit(0), cacheBytes(std::min((size_t)CACHE_BYTES, (size_t)DEFAULT_LIMIT / SHARDS)),
+        eviction(EVICT_LRU) {
+        for(int s = 0; s < SHARDS; ++s)
+            for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b) {
+                shards[s].available[b] = 0;
+                shards[s].depth[b].store(0, std::memory_order_relaxed);
+            }
+        for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b) {
+            lastUse[b].store(0, std::memory_order_relaxed);
+            reuses[b].store(0, std::memory_order_relaxed);
         }
     }
 
+    ~BufferPool() {
+        if(heap != 0)
+            releaseBuffers();
+    }
+
 private:
-    MemAllocator() {}
+    /////////////////////////////////////////////////////
+    /// \brief the buffers a thread returned and did not
+    ///        spill yet. only the owning thread touches the
+    ///        stacks, depth is atomic for stats()
+    ////////////////////////////////////////////////////
+    struct ThreadBuffers {
+        BufferHeader*          available[BufferHeader::BUCKETS];
+        std::atomic<uint32_t>  depth[BufferHeader::BUCKETS];
+        size_t                 bytes;
+        uint64_t               epoch;       ///< the drainEpoch this cache last drained for
+        int                    shard;       ///< the depot shard this thread spills to
+        BufferPool*            owner;
+        ThreadBuffers         *prev, *next; ///< registry links
+
+        BufferHeader* pop(unsigned bucket) {
+            BufferHeader* h = available[bucket];
+            if(h != 0) {
+                available[bucket] = h->next;
+                depth[bucket].store(depth[bucket].load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+                bytes -= BufferHeader::bucketBytes(bucket);
+                owner->cachedBytes -= BufferHeader::bucketBytes(bucket);
+            }
+            return h;
+        }
+
+        void push(BufferHeader* h) {
+            h->next = available[h->bucket];
+            available[h->bucket] = h;
+            depth[h->bucket].store(depth[h->bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            bytes += BufferHeader::bucketBytes(h->bucket);
+            owner->cachedBytes += BufferHeader::bucketBytes(h->bucket);
+        }
+    };
+
+    /////////////////////////////////////////////////////
+    /// \brief returns the caches of a thread to the depots
+    ///        when the thread exits
+    ////////////////////////////////////////////////////
+    struct ThreadBuffersReaper {
+        int touched;
+        ~ThreadBuffersReaper() {
+            for(int i = 0; i < POOLS_CACHED; ++i)
+                if(ThreadBuffers* cache = t_caches[i])
+                    cache->owner->retire(cache);
+        }
+    };
+
+    struct alignas(64) Shard {
+        std::mutex             mutex;
+        BufferHeader*          available[BufferHeader::BUCKETS];
+        std::atomic<uint32_t>  depth[BufferHeader::BUCKETS];
+    };
+
+    /// the cache of the calling thread for this pool, 0 if it has none
+    ThreadBuffers* ownCache() {
+        for(int i = 0; i < POOLS_CACHED; ++i)
+            if(t_caches[i] != 0 && t_caches[i]->owner == this)
+                return t_caches[i];
+        return 0;
+    }
+
+    /// the pools of one T share the slots of a thread, one beyond them goes
+    /// without a cache and straight to the depot
+    ThreadBuffers* threadBuffers() {
+        ThreadBuffers* cache = ownCache();
+        if(cache != 0)
+            return cache;
+
+        int slot = 0;
+        while(slot < POOLS_CACHED && t_caches[slot] != 0) ++slot;
+        if(slot == POOLS_CACHED)
+            return 0;
+
+        cache = new(Alloc::allocate(sizeof(ThreadBuffers))) ThreadBuffers;
+        for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b) {
+            cache->available[b] = 0;
+            cache->depth[b].store(0, std::memory_order_relaxed);
+        }
+        cache->bytes = 0;
+        cache->epoch = drainEpoch.load(std::memory_order_relaxed);
+        cache->owner = this;
+
+        std::unique_lock<std::mutex> lock(registryMutex);
+        cache->shard = threads++ % SHARDS;
+        cache->prev = 0;
+        cache->next = registry;
+        if(registry != 0) registry->prev = cache;
+        registry = cache;
+        lock.unlock();
+
+        // the first touch registers the destructor that returns the cache
+        t_reaper.touched = 1;
+        t_caches[slot] = cache;
+        return cache;
+    }
+
+    void retire(ThreadBuffers* cache) {
+        for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b)
+            if(cache->available[b] != 0)
+                spill(cache, b, cache->depth[b].load(std::memory_order_relaxed));
+
+        std::unique_lock<std::mutex> lock(registryMutex);
+        if(cache->prev != 0) cache->prev->next = cache->next;
+        else registry = cache->next;
+        if(cache->next != 0) cache->next->prev = cache->prev;
+        lock.unlock();
+
+        for(int i = 0; i < POOLS_CACHED; ++i)
+            if(t_caches[i] == cache) t_caches[i] = 0;
+        cache->~ThreadBuffers();
+        Alloc::deallocate((void*)cache, sizeof(ThreadBuffers));
+    }
+
+    /// an eviction that could not reach its target asked every thread to give its
+    /// cache to the depot, this thread does so and evicts what is still too much
+    void drain(ThreadBuffers* cache) {
+        cache->epoch = drainEpoch.load(std::memory_order_relaxed);
+        for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b)
+            if(cache->available[b] != 0)
+                spill(cache, b, cache->depth[b].load(std::memory_order_relaxed));
+        evict(drainTarget, true);
+    }
+
+    /// moves n buffers of a bucket from the thread cache to its depot shard
+    void spill(ThreadBuffers* cache, unsigned bucket, size_t n) {
+        BufferHeader* head = cache->pop(bucket);
+        BufferHeader* tail = head;
+        for(size_t i = 1; i < n; ++i) {
+            BufferHeader* h = cache->pop(bucket);
+            tail->next = h;
+            tail = h;
+        }
+        deposit(cache->shard, bucket, head, tail, n);
+    }
+
+    /// the depot shard of a thread without a cache
+    static int homeShard() {
+        return (int)(((uintptr_t)&t_caches >> 6) * 0x9e3779b97f4a7c15ULL >> 61) % SHARDS;
+    }
+
+    /// puts the chain head..tail of n buffers of a bucket in a depot shard
+    void deposit(int s, unsigned bucket, BufferHeader* head, BufferHeader* tail, size_t n) {
+        size_t bytes = BufferHeader::bucketBytes(bucket);
+        lastUse[bucket].store(++ticks, std::memory_order_relaxed);
+
+        Shard& shard = shards[s];
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        tail->next = shard.available[bucket];
+        shard.available[bucket] = head;
+        shard.depth[bucket].store(shard.depth[bucket].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        depotBytes += n * bytes;
+
+        // a size over its own limit gives back the surplus right here
+        BufferHeader* surplus = 0;
+        if(bucketLimit != 0) {
+            size_t waiting = depotDepth(bucket) * bytes;
+            while(waiting > bucketLimit && shard.available[bucket] != 0)
+                surplus = take(shard, bucket, surplus), waiting -= bytes;
+        }
+        lock.unlock();
+        freeList(surplus);
+
+        if(depotBytes + cachedBytes > highWatermark)
+            evict(lowWatermark, false);
+    }
+
+    size_t depotDepth(unsigned bucket) const {
+        size_t depth = 0;
+        for(int s = 0; s < SHARDS; ++s)
+            depth += shards[s].depth[bucket].load(std::memory_order_relaxed);
+        return depth;
+    }
+
+    /// moves the top buffer of a bucket of a locked shard onto list
+    BufferHeader* take(Shard& shard, unsigned bucket, BufferHeader* list) {
+        BufferHeader* h = shard.available[bucket];
+        shard.available[bucket] = h->next;
+        shard.depth[bucket].store(shard.depth[bucket].load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        depotBytes -= BufferHeader::bucketBytes(bucket);
+        h->next = list;
+        return h;
+    }
+
+    void freeList(BufferHeader* list) {
+        while(list != 0) {
+            BufferHeader* h = list;
+            list = h->next;
+            destroy((T*)h->data(), h->num);
+            dispose(h);
+            ++evicted;
+        }
+    }
+
+    /**
+     * @brief frees whole sizes of the depot, the coldest first, until at
+     *        most target bytes wait in the depot and the thread caches. a size
+     *        is only partly freed when that is enough to reach the target.
+     *        when the caches alone hold more, their threads drain them later
+     * @param wait whether to wait for an eviction already running
+     * @return the bytes freed
+     */
+    size_t evict(size_t target, bool wait) {
+        std::unique_lock<std::mutex> lock(evictMutex, std::defer_lock);
+        if(wait) lock.lock();
+        else if(!lock.try_lock()) return 0;
+
+        size_t freed = 0;
+        while(depotBytes + cachedBytes > target) {
+            unsigned victim = BufferHeader::BUCKETS;
+            uint64_t coldest = ~(uint64_t)0;
+            for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b) {
+                if(depotDepth(b) == 0) continue;
+                uint64_t heat = eviction == EVICT_LRU ? lastUse[b].load(std::memory_order_relaxed)
+                                                      : reuses[b].load(std::memory_order_relaxed);
+                if(heat < coldest) {
+                    coldest = heat;
+                    victim = b;
+                }
+            }
+            if(victim == BufferHeader::BUCKETS)
+                break;
+
+            for(int s = 0; s < SHARDS && depotBytes + cachedBytes > target; ++s) {
+                BufferHeader* list = 0;
+                {
+                    std::unique_lock<std::mutex> shardLock(shards[s].mutex);
+                    while(depotBytes + cachedBytes > target && shards[s].available[victim] != 0) {
+                        list = take(shards[s], victim, list);
+                        freed += BufferHeader::bucketBytes(victim);
+                    }
+                }
+                freeList(list);
+            }
+        }
+
+        if(depotBytes + cachedBytes > target) {
+            drainTarget = target;
+            drainEpoch.fetch_add(1, std::memory_order_release);
+        }
+
+        // the reuse counts decay, so sizes hot long ago cool down
+        if(eviction == EVICT_LFU)
+            for(unsigned b = 0; b < BufferHeader::BUCKETS; ++b)
+                reuses[b].store(reuses[b].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        return freed;
+    }
+
+    /// takes a batch of a bucket from the depot, returns one and caches the rest
+    BufferHeader* refill(ThreadBuffers* cache, unsigned bucket, size_t want = BATCH) {
+        int home = cache ? cache->shard : homeShard();
+        for(int i = 0; i < SHARDS; ++i) {
+            Shard& shard = shards[(home + i) % SHARDS];
+            if(shard.depth[bucket].load(std::memory_order_relaxed) == 0)
+                continue;
+
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            BufferHeader* result = shard.available[bucket];
+            if(result == 0)
+                continue;
+            BufferHeader* h = result->next;
+            uint32_t taken = 1;
+            for(; cache != 0 && h != 0 && taken < want; ++taken) {
+                BufferHeader* next = h->next;
+                cache->push(h);
+                h = next;
+            }
+            shard.available[bucket] = h;
+            shard.depth[bucket].store(shard.depth[bucket].load(std::memory_order_relaxed) - taken, std::memory_order_relaxed);
+            depotBytes -= taken * BufferHeader::bucketBytes(bucket);
+            lock.unlock();
+
+            lastUse[bucket].store(++ticks, std::memory_order_relaxed);
+            reuses[bucket].fetch_add(taken, std::memory_order_relaxed);
+            return result;
+        }
+        return 0;
+    }
+
+    static void construct(T* buffer, size_t num) {
+        if(!std::is_trivially_default_constructible<T>::value)
+            new(buffer)T[num];
+    }
+
+    static void destroy(T* buffer, size_t num) {
+        if(!std::is_trivially_destructible<T>::value) {
+            for(size_t i = 0; i < num; ++i)
+                buffer[i].~T();
+        }
+    }
+
+    void dispose(BufferHeader* h) {
+        h->magic = 0;
+        if(heap) heap->deallocate_aligned(h->block(), BufferHeader::bucketBytes(h->bucket), h->align);
+        else _Allocator::deallocate_aligned(h->block(), BufferHeader::bucketBytes(h->bucket), h->align);
+        --buffers;
+    }
 
 private:
     /////////////////////////////////////////////////////
     /// \brief memory pool
     ////////////////////////////////////////////////////
-    std::unordered_map<T*, size_t>               bufferSizes;
-    std::unordered_map<size_t, std::deque<T*> >  availableBuffers;
-    std::mutex                                   accessMutex;
+    Heap*                heap;              ///< where blocks come from, 0 for _Allocator
+    Shard                shards[SHARDS];
+    std::atomic<size_t>  buffers;           ///< buffers allocated and not released
+    std::mutex           registryMutex;
+    ThreadBuffers*       registry;          ///< the caches of the living threads
+    int                  threads;
+
+    std::atomic<size_t>  depotBytes;        ///< bytes waiting in the depot
+    std::atomic<size_t>  cachedBytes;       ///< bytes waiting in the thread caches
+    std::atomic<uint64_t> drainEpoch;       ///< bumped when the thread caches must go to the depot
+    std::atomic<size_t>  drainTarget;       ///< the bytes a drain evicts down to
+    std::atomic<size_t>  evicted;
+    std::atomic<uint64_t> ticks;            ///< ticks once per depot access
+    std::atomic<uint64_t> lastUse[BufferHeader::BUCKETS];
+    std::atomic<uint64_t> reuses[BufferHeader::BUCKETS];
+    std::mutex           evictMutex;
+
+    size_t               highWatermark;
+    size_t               lowWatermark;
+    size_t               bucketLimit;       ///< bytes one size may keep in the depot, 0 for none
+    size_t               cacheBytes;        ///< bytes one thread keeps for itself
+    BufferEviction       eviction;
+
+    static thread_local ThreadBuffers*     t_caches[POOLS_CACHED];
+    static thread_local ThreadBuffersReaper t_reaper;
+};
+
+template <typename T, typename _Allocator>
+thread_local typename BufferPool<T, _Allocator>::ThreadBuffers*
+    BufferPool<T, _Allocator>::t_caches[BufferPool<T, _Allocator>::POOLS_CACHED] = {0};
+
+template <typename T, typename _Allocator>
+thread_local typename BufferPool<T, _Allocator>::ThreadBuffersReaper
+    BufferPool<T, _Allocator>::t_reaper;
+
+
+/////////////////////////////////////////////////////////////////
+/// \brief when you need a manager to manage your memory,
+///        in order to improve some performance of your code,
+///        please use this class.
+///        there exist memory list for users to forbid allocate
+///        and deallocate memory frequently
+///
+/// @example in this example you can get 12 DataType objects
+///      DataType data* = MemAllocator<DataType>::Instance().getBuffer(12);
+///      MemAllocator<DataType>::Instance().releaseBuffer(data, 12);
+/////////////////////////////////////////////////////////////////
+template <typename T, typename _Allocator = Alloc>
+class MemAllocator : public BufferPool<T, _Allocator>
+{
+public:
+    /**
+     * @brief you are allow to use this function to get a object to manage your memory
+     * @return the memory manager
+     */
+    static MemAllocator<T, _Allocator>& Instance() {
+        static MemAllocator<T, _Allocator> theOneAndOnly;
+        return theOneAndOnly;
+    }
+
+    /**
+     * @brief a manager whose buffers come from heap instead of _Allocator.
+     *        it must be destroyed before the heap, and gives its buffers back
+     *        to the heap when it is
+     * @param heap the heap to allocate from
+     */
+    explicit MemAllocator(Heap& heap) : BufferPool<T, _Allocator>(&heap) {}
+
+private:
+    MemAllocator() {}
 };
 
 
@@ -234,30 +1623,6 @@ private:
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-__GEN_MEMALLOC_(int)
-__GEN_MEMALLOC_(float)
-__GEN_MEMALLOC_(char)
-__GEN_MEMALLOC_(double)
-__GEN_MEMALLOC_(unsigned int)
-__GEN_MEMALLOC_(unsigned char)
-__GEN_MEMALLOC_(short)
-__GEN_MEMALLOC_(unsigned short)
-__GEN_MEMALLOC_(long)
-__GEN_MEMALLOC_(unsigned long)
-
-__GEN_PT_MEMALLOC_(int)
-__GEN_PT_MEMALLOC_(float)
-__GEN_PT_MEMALLOC_(char)
-__GEN_PT_MEMALLOC_(double)
-__GEN_PT_MEMALLOC_(unsigned int)
-__GEN_PT_MEMALLOC_(unsigned char)
-__GEN_PT_MEMALLOC_(short)
-__GEN_PT_MEMALLOC_(unsigned short)
-__GEN_PT_MEMALLOC_(long)
-__GEN_PT_MEMALLOC_(unsigned long)
-
-
-
 typedef MemAllocator<void*> Allocator;
 
 } // end of namespace pi
@@ -26,6 +26,7 @@ LIBS        +=  -L$$OPENCV_DIR/lib \
                 -lopencv_ml -lopencv_nonfree -lopencv_objdetect \
                 -lopencv_photo -lopencv_stitching -lopencv_ts \
                 -lopencv_video -lopencv_videostab
+LIBS        += -lpthread -ldl -lrt
 
 OTHER_FILES += \
     README.md
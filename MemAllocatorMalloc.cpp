@@ -0,0 +1,215 @@
+/**
+ * @file  MemAllocatorMalloc.cpp
+ * @brief the malloc family on top of pi::Alloc, built as libMemAllocatorMalloc.so.
+ *         put it in front of the C library of any program with
+ *
+ *             LD_PRELOAD=./libMemAllocatorMalloc.so ./program
+ *
+ *         it also carries the operator new/delete of MemAllocatorNew.h.
+ *         blocks the library did not hand out (e.g. from the dynamic loader
+ *         before it was relocated) are ignored by free().
+ *
+ * @author lancelot
+ * @Email  3128243880@qq.com
+ * @date   20160727
+ * @version 1.3
+ */
+
+#include <atomic>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "MemAllocator.h"
+#include "MemAllocatorNew.h"
+
+namespace pi {
+
+////////////////////////////////////////////////////////////////////////////////
+/// building the default heap may itself call malloc (the C library does on
+/// the first use of some functions). such calls are served from a static
+/// buffer which is never given back, free() finds no page map entry for it
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+    BOOTSTRAP_BYTES = 256 << 10,
+    BOOTSTRAP_ALIGN = 16,
+    NOT_STARTED = 0,
+    STARTING = 1,
+    READY = 2
+};
+
+alignas(BOOTSTRAP_ALIGN) static char g_bootstrap[BOOTSTRAP_BYTES];
+static std::atomic<size_t> g_bootstrapUsed(0);
+static std::atomic<int>    g_mallocState(NOT_STARTED);
+
+/// set while the calling thread builds the default heap
+static thread_local bool   t_mallocStarting = false;
+
+/// a block of the bootstrap buffer, the size is kept in front of it for realloc()
+static void* BootstrapAllocate(size_t n, size_t alignment)
+{
+    if(alignment < BOOTSTRAP_ALIGN) alignment = BOOTSTRAP_ALIGN;
+    size_t used = g_bootstrapUsed.load(std::memory_order_relaxed);
+    for(;;) {
+        size_t start = (used + BOOTSTRAP_ALIGN + alignment - 1) & ~(alignment - 1);
+        if(n > BOOTSTRAP_BYTES || start > BOOTSTRAP_BYTES - n) return 0;
+        if(g_bootstrapUsed.compare_exchange_weak(used, start + n, std::memory_order_relaxed)) {
+            ((size_t*)(g_bootstrap + start))[-1] = n;
+            return g_bootstrap + start;
+        }
+    }
+}
+
+static inline bool IsBootstrap(void* p)
+{
+    return (char*)p >= g_bootstrap && (char*)p < g_bootstrap + BOOTSTRAP_BYTES;
+}
+
+static inline size_t BootstrapSize(void* p)
+{
+    return ((size_t*)p)[-1];
+}
+
+/// false when the call has to come from the bootstrap buffer
+static bool MallocReady()
+{
+    if(g_mallocState.load(std::memory_order_acquire) == READY) return true;
+    if(t_mallocStarting) return false;
+
+    int state = NOT_STARTED;
+    if(g_mallocState.compare_exchange_strong(state, STARTING, std::memory_order_acquire)) {
+        t_mallocStarting = true;
+        Alloc::deallocate(0);               // builds the default heap
+        t_mallocStarting = false;
+        g_mallocState.store(READY, std::memory_order_release);
+        return true;
+    }
+
+    while(g_mallocState.load(std::memory_order_acquire) != READY)
+        sched_yield();
+    return true;
+}
+
+static void* Allocate(size_t n)
+{
+    if(TooLarge(n)) {
+        errno = ENOMEM;
+        return 0;
+    }
+    void* p = MallocReady() ? Alloc::try_allocate(MallocSize(n)) : BootstrapAllocate(n, 0);
+    if(p == 0) errno = ENOMEM;
+    return p;
+}
+
+/// alignments above the page size are not supported and fail with EINVAL
+static int AllocateAligned(void** out, size_t alignment, size_t n)
+{
+    if(alignment == 0 || alignment & (alignment - 1) || alignment > (size_t)getpagesize())
+        return EINVAL;
+    if(TooLarge(n))
+        return ENOMEM;
+    *out = MallocReady() ? Alloc::try_allocate_aligned(n, alignment) : BootstrapAllocate(n, alignment);
+    return *out != 0 ? 0 : ENOMEM;
+}
+
+} // end of namespace pi
+
+
+extern "C" {
+
+void* malloc(size_t n)
+{
+    return pi::Allocate(n);
+}
+
+void free(void* p)
+{
+    // nothing freed while the heap is being built can be one of its blocks
+    if(p != 0 && !pi::IsBootstrap(p) && !pi::t_mallocStarting)
+        pi::Alloc::deallocate(p);
+}
+
+void cfree(void* p)
+{
+    free(p);
+}
+
+void* calloc(size_t count, size_t n)
+{
+    size_t bytes;
+    if(__builtin_mul_overflow(count, n, &bytes)) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    // the bootstrap buffer is never reused, it is still zero
+    void* p = pi::Allocate(bytes);
+    if(p != 0 && !pi::IsBootstrap(p)) memset(p, 0, bytes);
+    return p;
+}
+
+void* realloc(void* p, size_t n)
+{
+    if(p == 0) return pi::Allocate(n);
+    if(n == 0) {
+        free(p);
+        return 0;
+    }
+    if(pi::TooLarge(n)) {
+        errno = ENOMEM;
+        return 0;
+    }
+
+    if(pi::IsBootstrap(p)) {
+        void* result = pi::Allocate(n);
+        if(result != 0) memcpy(result, p, std::min(n, pi::BootstrapSize(p)));
+        return result;
+    }
+    if(!pi::MallocReady()) return 0;
+
+    void* result = pi::Alloc::try_reallocate(p, pi::MallocSize(n));
+    if(result == 0) errno = ENOMEM;
+    return result;
+}
+
+int posix_memalign(void** out, size_t alignment, size_t n)
+{
+    if(alignment % sizeof(void*) != 0) return EINVAL;
+    return pi::AllocateAligned(out, alignment, n);
+}
+
+void* memalign(size_t alignment, size_t n)
+{
+    void* p = 0;
+    int error = pi::AllocateAligned(&p, alignment, n);
+    if(error != 0) errno = error;
+    return p;
+}
+
+void* aligned_alloc(size_t alignment, size_t n)
+{
+    return memalign(alignment, n);
+}
+
+void* valloc(size_t n)
+{
+    return memalign(getpagesize(), n);
+}
+
+void* pvalloc(size_t n)
+{
+    size_t page = getpagesize();
+    return memalign(page, (n + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void* p)
+{
+    if(p == 0) return 0;
+    if(pi::IsBootstrap(p)) return pi::BootstrapSize(p);
+    if(pi::t_mallocStarting) return 0;
+    return pi::Alloc::usable_size(p);
+}
+
+} // extern "C"
@@ -0,0 +1,16 @@
+QMAKE_CXXFLAGS += -std=c++17 -O2 -ftls-model=initial-exec
+
+TEMPLATE = lib
+OBJECTS_DIR = ./build_malloc
+TARGET = MemAllocatorMalloc
+
+
+HEADERS += \
+    MemAllocator.h \
+    MemAllocatorNew.h
+
+SOURCES += \
+    MemAllocatorMalloc.cpp \
+    MemAllocator.cpp
+
+LIBS += -lpthread -ldl -lrt
@@ -0,0 +1,174 @@
+/**
+ * @file  MemAllocatorNew.h
+ * @brief replaces the global operator new/delete by pi::Alloc.
+ *         the replacements are ordinary (non-inline) definitions, so include
+ *         this file in exactly one source file of the program, e.g. the one
+ *         with main(). the LD_PRELOAD library libMemAllocatorMalloc.so
+ *         already contains them.
+ *
+ *         sized delete goes straight to the size class, unsized delete and
+ *         delete of an aligned object look the size up in the page map.
+ *         alignments above the page size are not supported, operator new
+ *         throws std::bad_alloc for them.
+ *
+ * @author lancelot
+ * @Email  3128243880@qq.com
+ * @date   20160727
+ * @version 1.3
+ */
+
+#ifndef MEMALLOCATORNEW_H
+#define MEMALLOCATORNEW_H
+
+#include <new>
+#include <stdint.h>
+#include "MemAllocator.h"
+
+namespace pi {
+
+/// malloc and operator new hand out 16 byte aligned blocks, as the x86-64 ABI
+/// expects. the classes of a multiple of 16 bytes are, and a block of at most
+/// 8 bytes holds no object that needs more
+static inline size_t MallocSize(size_t n)
+{
+    return n <= 8 ? n : (n + 15) & ~(size_t)15;
+}
+
+/// a size no block can have, it would not even fit the address space
+static inline bool TooLarge(size_t n)
+{
+    return n > (size_t)PTRDIFF_MAX;
+}
+
+/// operator new semantics: call the new handler until it gives up, then throw
+template <typename F>
+static void* NewOrThrow(size_t n, F allocate)
+{
+    if(TooLarge(n)) throw std::bad_alloc();
+    for(;;) {
+        void* p = allocate();
+        if(p != 0) return p;
+
+        std::new_handler handler = std::get_new_handler();
+        if(handler == 0) throw std::bad_alloc();
+        handler();
+    }
+}
+
+template <typename F>
+static void* NewOrNull(size_t n, F allocate) noexcept
+{
+    try {
+        return NewOrThrow(n, allocate);
+    } catch(...) {
+        return 0;
+    }
+}
+
+} // end of namespace pi
+
+void* operator new(size_t n)
+{
+    return pi::NewOrThrow(n, [n]() { return pi::Alloc::try_allocate(pi::MallocSize(n)); });
+}
+
+void* operator new[](size_t n)
+{
+    return pi::NewOrThrow(n, [n]() { return pi::Alloc::try_allocate(pi::MallocSize(n)); });
+}
+
+void* operator new(size_t n, const std::nothrow_t&) noexcept
+{
+    return pi::NewOrNull(n, [n]() { return pi::Alloc::try_allocate(pi::MallocSize(n)); });
+}
+
+void* operator new[](size_t n, const std::nothrow_t&) noexcept
+{
+    return pi::NewOrNull(n, [n]() { return pi::Alloc::try_allocate(pi::MallocSize(n)); });
+}
+
+void operator delete(void* p) noexcept
+{
+    if(p) pi::Alloc::deallocate(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    if(p) pi::Alloc::deallocate(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    if(p) pi::Alloc::deallocate(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    if(p) pi::Alloc::deallocate(p);
+}
+
+#if defined(__cpp_sized_deallocation)
+void operator delete(void* p, size_t n) noexcept
+{
+    if(p) pi::Alloc::deallocate(p, pi::MallocSize(n));
+}
+
+void operator delete[](void* p, size_t n) noexcept
+{
+    if(p) pi::Alloc::deallocate(p, pi::MallocSize(n));
+}
+#endif
+
+#if defined(__cpp_aligned_new)
+void* operator new(size_t n, std::align_val_t al)
+{
+    return pi::NewOrThrow(n, [n, al]() { return pi::Alloc::try_allocate_aligned(n, (size_t)al); });
+}
+
+void* operator new[](size_t n, std::align_val_t al)
+{
+    return pi::NewOrThrow(n, [n, al]() { return pi::Alloc::try_allocate_aligned(n, (size_t)al); });
+}
+
+void* operator new(size_t n, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    return pi::NewOrNull(n, [n, al]() { return pi::Alloc::try_allocate_aligned(n, (size_t)al); });
+}
+
+void* operator new[](size_t n, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    return pi::NewOrNull(n, [n, al]() { return pi::Alloc::try_allocate_aligned(n, (size_t)al); });
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+    if(p) pi::Alloc::deallocate(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept
+{
+    if(p) pi::Alloc::deallocate(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    if(p) pi::Alloc::deallocate(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    if(p) pi::Alloc::deallocate(p);
+}
+
+void operator delete(void* p, size_t n, std::align_val_t al) noexcept
+{
+    if(p) pi::Alloc::deallocate_aligned(p, n, (size_t)al);
+}
+
+void operator delete[](void* p, size_t n, std::align_val_t al) noexcept
+{
+    if(p) pi::Alloc::deallocate_aligned(p, n, (size_t)al);
+}
+#endif
+
+#endif // end of MEMALLOCATORNEW_H
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <set>
+#include <vector>
+
+#include "MemAllocator.h"
+
+
+using namespace pi;
+
+////////////////////////////////////////////////////////////////////////////////
+/// allocate_batch and deallocate_batch round trips: from a warm shared list,
+/// from an empty one (a fresh heap carves everything) and through a thread
+/// cache that holds part of the batch. every block must be distinct, usable
+/// for its size, and counted once in the stats
+////////////////////////////////////////////////////////////////////////////////
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { if(!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+enum { SIZE = 64, COUNT = 1000 };
+
+static size_t allocsOf(const AllocStats& st, size_t size)
+{
+    for(size_t i = 0; i < st.classes.size(); ++i)
+        if(st.classes[i].size == size) return st.classes[i].allocs;
+    return 0;
+}
+
+/// distinct, writable blocks of at least n bytes
+static void checkBlocks(void** blocks, size_t count, size_t n, size_t (*usable)(void*))
+{
+    std::set<void*> distinct(blocks, blocks + count);
+    CHECK(distinct.size() == count);
+    for(size_t i = 0; i < count; ++i) {
+        CHECK(blocks[i] != 0 && usable(blocks[i]) >= n);
+        memset(blocks[i], (int)i, n);
+    }
+    for(size_t i = 0; i < count; ++i)
+        CHECK(((unsigned char*)blocks[i])[n - 1] == (unsigned char)i);
+}
+
+static size_t defaultUsable(void* p) { return Alloc::usable_size(p); }
+
+static Heap* g_heap = 0;
+static size_t heapUsable(void* p) { return g_heap->usable_size(p); }
+
+int main()
+{
+    std::vector<void*> blocks(COUNT);
+
+    // warm: the shared list holds more than the batch needs
+    {
+        std::vector<void*> warm(2 * COUNT);
+        for(size_t i = 0; i < warm.size(); ++i) warm[i] = Alloc::allocate(SIZE);
+        Alloc::deallocate_batch(warm.data(), warm.size(), SIZE);
+
+        size_t before = allocsOf(Alloc::stats(), SIZE);
+        CHECK(Alloc::allocate_batch(SIZE, COUNT, blocks.data()) == COUNT);
+        CHECK(allocsOf(Alloc::stats(), SIZE) - before == COUNT);
+        checkBlocks(blocks.data(), COUNT, SIZE, defaultUsable);
+
+        // no superblock beyond the warm ones was needed
+        std::set<void*> fromList(warm.begin(), warm.end());
+        size_t reused = 0;
+        for(size_t i = 0; i < COUNT; ++i) reused += fromList.count(blocks[i]);
+        CHECK(reused > COUNT / 2);
+        Alloc::deallocate_batch(blocks.data(), COUNT, SIZE);
+    }
+
+    // empty: a fresh heap has nothing on its lists, the batch is carved
+    {
+        Heap heap;
+        g_heap = &heap;
+        CHECK(heap.allocate_batch(SIZE, COUNT, blocks.data()) == COUNT);
+        checkBlocks(blocks.data(), COUNT, SIZE, heapUsable);
+        heap.deallocate_batch(blocks.data(), COUNT, SIZE);
+
+        // and back again, now from the list the first batch left
+        CHECK(heap.allocate_batch(SIZE, COUNT, blocks.data()) == COUNT);
+        checkBlocks(blocks.data(), COUNT, SIZE, heapUsable);
+        heap.deallocate_batch(blocks.data(), COUNT, SIZE);
+        g_heap = 0;
+    }
+
+    // partly filled thread cache: what it holds goes out first
+    {
+        enum { CACHED = 10 };
+        void* cached[CACHED];
+        for(int i = 0; i < CACHED; ++i) cached[i] = Alloc::allocate(SIZE);
+        for(int i = 0; i < CACHED; ++i) Alloc::deallocate(cached[i], SIZE);
+
+        size_t before = allocsOf(Alloc::stats(), SIZE);
+        CHECK(Alloc::allocate_batch(SIZE, COUNT, blocks.data()) == COUNT);
+        CHECK(allocsOf(Alloc::stats(), SIZE) - before == COUNT);
+        checkBlocks(blocks.data(), COUNT, SIZE, defaultUsable);
+
+        std::set<void*> got(blocks.begin(), blocks.end());
+        for(int i = 0; i < CACHED; ++i) CHECK(got.count(cached[i]) == 1);
+        Alloc::deallocate_batch(blocks.data(), COUNT, SIZE);
+    }
+
+    // large blocks go one span each
+    {
+        void* large[8];
+        CHECK(Alloc::allocate_batch(100000, 8, large) == 8);
+        checkBlocks(large, 8, 100000, defaultUsable);
+        Alloc::deallocate_batch(large, 8, 100000);
+    }
+
+    // buffers: a batch of distinct buffers, reused after they come back
+    {
+        enum { BUFFERS = 16 };
+        char* buffers[BUFFERS];
+        CHECK(MemAllocator<char>::Instance().getBuffers(4000, BUFFERS, buffers) == BUFFERS);
+        std::set<char*> distinct(buffers, buffers + BUFFERS);
+        CHECK(distinct.size() == BUFFERS);
+        for(int i = 0; i < BUFFERS; ++i) MemAllocator<char>::Instance().returnBuffer(buffers[i]);
+
+        size_t created = MemAllocator<char>::Instance().stats().buffers;
+        CHECK(MemAllocator<char>::Instance().getBuffers(4000, BUFFERS, buffers) == BUFFERS);
+        CHECK(MemAllocator<char>::Instance().stats().buffers == created);
+        for(int i = 0; i < BUFFERS; ++i) MemAllocator<char>::Instance().releaseBuffer(buffers[i]);
+        CHECK(MemAllocator<char>::Instance().stats().buffers == 0);
+    }
+
+    printf(failures ? "FAILED\n" : "PASSED\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+#include <stdio.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "MemAllocator.h"
+
+
+using namespace pi;
+
+////////////////////////////////////////////////////////////////////////////////
+/// the limits of a MemAllocator: the waiting buffers stay under the high
+/// watermark even when many threads cache them, trim reaches into the caches
+/// of other threads, and eviction picks the least recently or the least often
+/// reused size. pools over a heap of their own have no thread caches, so their
+/// eviction order is exact
+////////////////////////////////////////////////////////////////////////////////
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { if(!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+enum { THREADS = 16, PER_THREAD = 8, SIZE = 15000, HIGH = 1 << 20 };
+
+/// the threads of a test step through the phases together with main
+class Phases {
+public:
+    Phases() : phase(0), arrived(0) {}
+
+    /// a worker done with phase now waits for main to start the next
+    void done(int now) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ++arrived;
+        cond.notify_all();
+        cond.wait(lock, [&] { return phase > now; });
+    }
+
+    /// main waits for n workers, then lets them go on with the next phase
+    void next(int n) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&] { return arrived == n; });
+        arrived = 0;
+        ++phase;
+        cond.notify_all();
+    }
+
+    /// main waits for n workers to finish the phase, they wait on
+    void await(int n) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&] { return arrived == n; });
+    }
+
+private:
+    std::mutex              mutex;
+    std::condition_variable cond;
+    int                     phase, arrived;
+};
+
+static size_t waiting(const BufferStats& st, size_t size)
+{
+    for(size_t i = 0; i < st.available.size(); ++i)
+        if(st.available[i].first >= size && st.available[i].first < 2 * size)
+            return st.available[i].second;
+    return 0;
+}
+
+/// many threads each keep up to HIGH / SHARDS: together they stay under HIGH
+static void cachesUnderWatermark()
+{
+    MemAllocator<char>& pool = MemAllocator<char>::Instance();
+    pool.setLimit(HIGH);
+    Phases phases;
+    std::mutex one;
+
+    std::vector<std::thread> threads;
+    for(int t = 0; t < THREADS; ++t)
+        threads.push_back(std::thread([&] {
+            char* buffers[PER_THREAD];
+            for(int i = 0; i < PER_THREAD; ++i) buffers[i] = pool.getBuffer(SIZE);
+            for(int i = 0; i < PER_THREAD; ++i) pool.returnBuffer(buffers[i]);
+            phases.done(0);
+
+            // after a trim by main the next access gives the cache to the depot. one thread
+            // at a time, else one could refill from what another just spilled
+            {
+                std::unique_lock<std::mutex> lock(one);
+                pool.releaseBuffer(pool.getBuffer(SIZE));
+            }
+            phases.done(1);
+        }));
+
+    phases.await(THREADS);
+    BufferStats st = pool.stats();
+    CHECK(st.idle_bytes <= HIGH);
+    CHECK(st.idle_bytes > 0);
+
+    pool.trim(0);
+    phases.next(THREADS);
+    phases.await(THREADS);
+    CHECK(pool.stats().idle_bytes == 0);
+    phases.next(THREADS);
+
+    for(size_t t = 0; t < threads.size(); ++t) threads[t].join();
+    pool.releaseBuffers();
+    CHECK(pool.stats().buffers == 0);
+}
+
+/// the depot evicts down to the low watermark once it passes the high one
+static void watermarks()
+{
+    Heap heap;
+    MemAllocator<char> pool(heap);
+    enum { BUFFERS = 32, LIMIT = 10 };
+
+    std::vector<char*> buffers;
+    for(int i = 0; i < BUFFERS; ++i) buffers.push_back(pool.getBuffer(SIZE));
+    pool.returnBuffer(buffers[0]);
+    size_t bytes = pool.stats().idle_bytes;
+    pool.setLimit(LIMIT * bytes, LIMIT / 2 * bytes);
+
+    size_t most = bytes;
+    for(int i = 1; i < BUFFERS; ++i) {
+        pool.returnBuffer(buffers[i]);
+        most = std::max(most, pool.stats().idle_bytes);
+    }
+    BufferStats st = pool.stats();
+    CHECK(most <= LIMIT * bytes);
+    CHECK(st.idle_bytes <= LIMIT * bytes);
+    CHECK(st.evicted >= BUFFERS - LIMIT);
+    CHECK(st.buffers == st.idle_bytes / bytes);
+}
+
+/// a size reused often long ago and one returned once just now: LRU evicts the
+/// first, LFU the second
+static void evictionOrder(BufferEviction policy)
+{
+    Heap heap;
+    MemAllocator<char> pool(heap);
+    pool.setEviction(policy);
+    enum { OFTEN = 1000, ONCE = 3000, COUNT = 4 };
+
+    char* buffers[COUNT];
+    for(int round = 0; round < 10; ++round) {
+        for(int i = 0; i < COUNT; ++i) buffers[i] = pool.getBuffer(OFTEN);
+        for(int i = 0; i < COUNT; ++i) pool.returnBuffer(buffers[i]);
+    }
+    for(int i = 0; i < COUNT; ++i) buffers[i] = pool.getBuffer(ONCE);
+    for(int i = 0; i < COUNT; ++i) pool.returnBuffer(buffers[i]);
+
+    BufferStats st = pool.stats();
+    CHECK(waiting(st, OFTEN) == COUNT && waiting(st, ONCE) == COUNT);
+
+    // one byte over the target frees exactly one buffer of the coldest size
+    CHECK(pool.trim(st.idle_bytes - 1) > 0);
+    st = pool.stats();
+    size_t often = policy == EVICT_LRU ? COUNT - 1 : COUNT;
+    CHECK(waiting(st, OFTEN) == often);
+    CHECK(waiting(st, ONCE) == 2 * COUNT - 1 - often);
+    CHECK(st.evicted == 1);
+}
+
+int main()
+{
+    cachesUnderWatermark();
+    watermarks();
+    evictionOrder(EVICT_LRU);
+    evictionOrder(EVICT_LFU);
+
+    printf(failures ? "FAILED\n" : "PASSED\n");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// the malloc family of libMemAllocatorMalloc.so, run as
+///
+///     LD_PRELOAD=/abs/path/libMemAllocatorMalloc.so ./Test_Malloc
+///
+/// realloc and memalign keep their contents and alignment, a child forked while
+/// another thread allocates can allocate too, and running out of address space
+/// makes malloc, realloc and memalign return 0 with ENOMEM instead of ending
+/// the process. the original block of a failed realloc stays intact
+////////////////////////////////////////////////////////////////////////////////
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { if(!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+/// whether malloc comes from the preloaded library
+static bool preloaded()
+{
+    Dl_info info;
+    void* sym = dlsym(RTLD_DEFAULT, "malloc");
+    return sym != 0 && dladdr(sym, &info) != 0 && info.dli_fname != 0 &&
+           strstr(info.dli_fname, "MemAllocatorMalloc") != 0;
+}
+
+static void fill(void* p, size_t n, int seed)
+{
+    for(size_t i = 0; i < n; ++i) ((unsigned char*)p)[i] = (unsigned char)(seed + i * 7);
+}
+
+static bool intact(const void* p, size_t n, int seed)
+{
+    for(size_t i = 0; i < n; ++i)
+        if(((const unsigned char*)p)[i] != (unsigned char)(seed + i * 7)) return false;
+    return true;
+}
+
+/// grows a block through every size class into large spans and back
+static void reallocs()
+{
+    size_t n = 1;
+    char* p = (char*)malloc(n);
+    fill(p, n, 1);
+    for(; n < (8 << 20); n = n * 3 / 2 + 1) {
+        char* q = (char*)realloc(p, n * 3 / 2 + 1);
+        CHECK(q != 0 && intact(q, n, 1));
+        if(q == 0) break;
+        p = q;
+        fill(p, n * 3 / 2 + 1, 1);
+    }
+    p = (char*)realloc(p, 100);
+    CHECK(p != 0 && intact(p, 100, 1));
+    free(p);
+}
+
+static void memaligns()
+{
+    for(size_t align = 8; align <= 4096; align *= 2)
+        for(size_t n = 1; n < (1 << 20); n = n * 5 + 3) {
+            void* p = memalign(align, n);
+            CHECK(p != 0 && (uintptr_t)p % align == 0 && malloc_usable_size(p) >= n);
+            if(p) fill(p, n, (int)align);
+            CHECK(p == 0 || intact(p, n, (int)align));
+            free(p);
+
+            void* q = 0;
+            CHECK(posix_memalign(&q, align, n) == 0 && (uintptr_t)q % align == 0);
+            free(q);
+        }
+
+    // beyond a page is refused, not served misaligned
+    void* p = 0;
+    CHECK(posix_memalign(&p, 1 << 16, 100) == EINVAL);
+}
+
+/// children forked while another thread allocates find the heap usable
+static void forks()
+{
+    std::atomic<bool> stop(false);
+    std::thread busy([&] {
+        while(!stop.load()) {
+            void* blocks[64];
+            for(int i = 0; i < 64; ++i) blocks[i] = malloc(16 + i * 40);
+            for(int i = 0; i < 64; ++i) free(blocks[i]);
+        }
+    });
+
+    for(int round = 0; round < 20; ++round) {
+        pid_t child = fork();
+        if(child == 0) {
+            int ok = 1;
+            for(int i = 0; i < 1000; ++i) {
+                char* p = (char*)malloc(1 + i * 13);
+                char* q = (char*)realloc(p, 200000);
+                ok &= q != 0;
+                free(q);
+            }
+            _exit(ok ? 0 : 1);
+        }
+        int status = 0;
+        CHECK(child > 0 && waitpid(child, &status, 0) == child);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    stop = true;
+    busy.join();
+}
+
+/// with the address space capped, what does not fit fails and the rest works on
+static void outOfMemory()
+{
+    enum { HEADROOM = 256 << 20 };
+    size_t pages = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    CHECK(f != 0 && fscanf(f, "%zu", &pages) == 1);
+    if(f) fclose(f);
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_AS, &limit);
+    struct rlimit capped = limit;
+    capped.rlim_cur = pages * getpagesize() + HEADROOM;
+    CHECK(setrlimit(RLIMIT_AS, &capped) == 0);
+
+    size_t huge = (size_t)4 << 30;
+    errno = 0;
+    CHECK(malloc(huge) == 0 && errno == ENOMEM);
+    CHECK(memalign(4096, huge) == 0);
+
+    char* p = (char*)malloc(1 << 20);
+    CHECK(p != 0);
+    if(p) {
+        fill(p, 1 << 20, 3);
+        errno = 0;
+        CHECK(realloc(p, huge) == 0 && errno == ENOMEM);
+        CHECK(intact(p, 1 << 20, 3));
+        free(p);
+    }
+
+    // small blocks still come
+    void* blocks[1000];
+    for(int i = 0; i < 1000; ++i) CHECK((blocks[i] = malloc(100)) != 0);
+    for(int i = 0; i < 1000; ++i) free(blocks[i]);
+
+    // use the headroom up, large spans and superblocks alike: the page map,
+    // the superblocks and the large spans fail softly wherever the limit hits them
+    enum { MAX_BLOCKS = 4096 };
+    static void* held[MAX_BLOCKS];
+    int n = 0;
+    for(; n < MAX_BLOCKS; ++n) {
+        held[n] = malloc(n % 2 ? 1 << 20 : 3000);
+        if(held[n] == 0) break;
+    }
+    CHECK(n < MAX_BLOCKS);
+    for(int i = 0; i < n; ++i) free(held[i]);
+    CHECK((p = (char*)malloc(1 << 20)) != 0);
+    free(p);
+
+    setrlimit(RLIMIT_AS, &limit);
+}
+
+int main()
+{
+    if(!preloaded()) {
+        printf("malloc is not libMemAllocatorMalloc.so, run with LD_PRELOAD\n");
+        printf("FAILED\n");
+        return 1;
+    }
+
+    reallocs();
+    memaligns();
+    forks();
+    outOfMemory();
+
+    printf(failures ? "FAILED\n" : "PASSED\n");
+    return failures ? 1 : 0;
+}
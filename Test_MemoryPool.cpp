@@ -24,8 +24,7 @@ void func1() {
     printf("enter thread 1\n");
     Data *mat = (Data*)Allocator::Instance().getBuffer(2 * sizeof(Data));
     new(mat)Data[2];
-    Data *mat1 = (Data*)Allocator::Instance().getBuffer(sizeof(Data));
-    new(mat1)Data(12, 32);
+    pooled_ptr<Data> mat1 = make_pooled<Data>(12, 32);
     printf("hello 1!\n");
     for(int i = 0; i < 2; ++i) {
         char buffer[512];
@@ -37,8 +36,6 @@ void func1() {
     }
 
     Allocator::Instance().returnBuffer(mat);
-    mat1->~Data();
-    Allocator::Instance().releaseBuffer(mat1);
 }
 
 void func2() {
@@ -70,7 +67,7 @@ void func2() {
 void testAlloc() {
     int *data1;
     char *data2;
-    while(true) {
+    for(int i = 0; i < 1000000; ++i) {
         data1 = (int*)Alloc::allocate(1024 * sizeof(int));
         data2 = (char*)Alloc::allocate(32);
         //! do some thing
@@ -86,8 +83,9 @@ int main() {
     std::thread th2(func2);
 
     std::thread th3(testAlloc);
-    while(true);
-    std::cin.get();
+    th1.join();
+    th2.join();
+    th3.join();
 
     return 0;
 }
@@ -0,0 +1,121 @@
+#include <stdio.h>
+
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "MemAllocator.h"
+
+
+using namespace pi;
+
+////////////////////////////////////////////////////////////////////////////////
+/// a simulated topology of two nodes: threads are spread round-robin over the
+/// nodes in the order they first allocate, so main is on node 0, the first
+/// thread it starts on node 1 and so on. objects freed on a node that does not
+/// own them must end up on the list of their own arena, which the next thread
+/// of that node gets them from first: a remote free, a batch of both nodes
+/// split by release(), and a thread whose node changes under it
+////////////////////////////////////////////////////////////////////////////////
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { if(!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+enum { SIZE = 64, COUNT = 200 };
+
+typedef std::vector<void*> Blocks;
+
+/// runs body on a new thread, which takes the next sequence number as it allocates
+template<typename Body>
+static void onThread(Body body)
+{
+    std::thread t(body);
+    t.join();
+}
+
+static Blocks allocate(size_t count)
+{
+    Blocks blocks(count);
+    for(size_t i = 0; i < count; ++i) blocks[i] = Alloc::allocate(SIZE);
+    return blocks;
+}
+
+static void deallocate(const Blocks& blocks)
+{
+    for(size_t i = 0; i < blocks.size(); ++i) Alloc::deallocate(blocks[i], SIZE);
+}
+
+/// how many of the blocks a new thread allocates first were among owned
+static size_t reusedOf(const Blocks& owned)
+{
+    std::set<void*> from(owned.begin(), owned.end());
+    size_t reused = 0;
+    onThread([&] {
+        Blocks got = allocate(owned.size());
+        for(size_t i = 0; i < got.size(); ++i) reused += from.count(got[i]);
+        deallocate(got);
+    });
+    return reused;
+}
+
+int main()
+{
+    Alloc::setNumaNodes(2);
+    void* first = Alloc::allocate(SIZE);         // main is thread 0, node 0
+
+    // remote free: main frees what a node 1 thread allocated
+    {
+        Blocks remote;
+        onThread([&] { remote = allocate(COUNT); });                        // thread 1, node 1
+
+        size_t before = Alloc::stats().remote_frees;
+        deallocate(remote);
+        CHECK(Alloc::stats().remote_frees - before == COUNT);
+
+        CHECK(reusedOf(remote) == 0);                                       // thread 2, node 0
+        CHECK(reusedOf(remote) == COUNT);                                   // thread 3, node 1
+    }
+
+    // one batch of both nodes is split into runs, each goes to its own arena
+    {
+        Blocks local, remote;
+        onThread([&] { local = allocate(COUNT); });                         // thread 4, node 0
+        onThread([&] { remote = allocate(COUNT); });                        // thread 5, node 1
+
+        Blocks mixed;
+        for(size_t i = 0; i < COUNT; ++i) {
+            mixed.push_back(local[i]);
+            mixed.push_back(remote[i]);
+        }
+        Alloc::deallocate_batch(mixed.data(), mixed.size(), SIZE);
+
+        CHECK(reusedOf(local) == COUNT);                                    // thread 6, node 0
+        CHECK(reusedOf(remote) == COUNT);                                   // thread 7, node 1
+    }
+
+    // a thread that moves from node 1 to node 0 frees its node 1 objects remotely
+    {
+        Blocks moved;
+        onThread([] { Alloc::deallocate(Alloc::allocate(SIZE), SIZE); });   // thread 8, node 0
+        onThread([&] {                                                      // thread 9, node 1
+            moved = allocate(COUNT);
+
+            // three nodes put thread 9 on node 0, its next refill notices
+            Alloc::setNumaNodes(3);
+            Alloc::deallocate(Alloc::allocate(4 * SIZE), 4 * SIZE);
+
+            size_t before = Alloc::stats().remote_frees;
+            deallocate(moved);
+            CHECK(Alloc::stats().remote_frees - before == COUNT);
+        });
+
+        CHECK(reusedOf(moved) == COUNT);                                    // thread 10, node 1
+    }
+
+    Alloc::deallocate(first, SIZE);
+
+    printf(failures ? "FAILED\n" : "PASSED\n");
+    return failures ? 1 : 0;
+}
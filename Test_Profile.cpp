@@ -0,0 +1,90 @@
+#include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "MemAllocator.h"
+
+
+using namespace pi;
+
+////////////////////////////////////////////////////////////////////////////////
+/// the heap profiler samples every allocation at an interval of one byte: a
+/// live allocation shows up in profile() with its bytes and is gone after the
+/// free, a reallocation moves the sample and a failed one keeps it. a signal
+/// set without a prefix dumps the profile to pi.<pid>.<n>.heap
+////////////////////////////////////////////////////////////////////////////////
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { if(!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+enum { SIZE = 300000 };
+
+/// live samples and their bytes from the header of the pprof profile
+static bool liveOf(unsigned long long& live, unsigned long long& bytes)
+{
+    std::string text = Alloc::profile(PROFILE_PPROF);
+    return sscanf(text.c_str(), "heap profile: %llu: %llu", &live, &bytes) == 2;
+}
+
+int main()
+{
+    unsigned long long live0 = 0, bytes0 = 0, live = 0, bytes = 0;
+    CHECK(Alloc::profile().empty());
+
+    Alloc::setSampling(1);
+    CHECK(liveOf(live0, bytes0));
+
+    void* p = Alloc::allocate(SIZE);
+    CHECK(liveOf(live, bytes));
+    CHECK(live == live0 + 1 && bytes == bytes0 + SIZE);
+
+    // the sample follows the block to its new size
+    p = Alloc::reallocate(p, SIZE, 2 * SIZE);
+    CHECK(p != 0);
+    CHECK(liveOf(live, bytes));
+    CHECK(live == live0 + 1 && bytes == bytes0 + 2 * SIZE);
+
+    // a reallocation that fails leaves the block and its sample alone
+    {
+        struct rlimit limit, capped;
+        getrlimit(RLIMIT_AS, &limit);
+        capped = limit;
+        capped.rlim_cur = (size_t)1 << 32;
+        setrlimit(RLIMIT_AS, &capped);
+        void* q = Alloc::try_reallocate(p, (size_t)8 << 30);
+        setrlimit(RLIMIT_AS, &limit);
+
+        CHECK(q == 0);
+        CHECK(liveOf(live, bytes));
+        CHECK(live == live0 + 1 && bytes == bytes0 + 2 * SIZE);
+    }
+
+    Alloc::deallocate(p, 2 * SIZE);
+    CHECK(liveOf(live, bytes));
+    CHECK(live == live0 && bytes == bytes0);
+
+    // no prefix dumps to pi.<pid>.0000.heap
+    char path[64];
+    snprintf(path, sizeof(path), "pi.%d.0000.heap", (int)getpid());
+    unlink(path);
+    Alloc::setProfileSignal(SIGUSR2, 0);
+    raise(SIGUSR2);
+    bool dumped = false;
+    for(int i = 0; i < 200 && !dumped; ++i) {
+        usleep(10000);
+        dumped = access(path, R_OK) == 0;
+    }
+    CHECK(dumped);
+    CHECK(Alloc::setProfileSignal(0) == SIGUSR2);
+    unlink(path);
+
+    Alloc::setSampling(0);
+
+    printf(failures ? "FAILED\n" : "PASSED\n");
+    return failures ? 1 : 0;
+}
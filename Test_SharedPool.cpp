@@ -0,0 +1,138 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "MemAllocator.h"
+
+
+using namespace pi;
+
+////////////////////////////////////////////////////////////////////////////////
+/// two processes share one memfd pool: the parent fills buffers of changing
+/// sizes and hands their handles over a unix socket, the child maps the pool
+/// at its own address, checks every byte and returns the buffers from there.
+/// exits with 0 when every buffer came intact and all were returned
+////////////////////////////////////////////////////////////////////////////////
+
+enum { FRAMES = 2000, POOL_BYTES = 16 << 20 };
+
+struct Frame {
+    SharedPool::Handle handle;
+    uint32_t           id;
+    uint32_t           bytes;
+};
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { if(!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while(0)
+
+static unsigned char pattern(uint32_t id, size_t i)
+{
+    return (unsigned char)(id * 131 + i * 7 + (i >> 8));
+}
+
+static bool sendAll(int fd, const void* data, size_t n)
+{
+    for(size_t done = 0; done < n;) {
+        ssize_t k = write(fd, (const char*)data + done, n - done);
+        if(k <= 0) return false;
+        done += k;
+    }
+    return true;
+}
+
+static bool receiveAll(int fd, void* data, size_t n)
+{
+    for(size_t done = 0; done < n;) {
+        ssize_t k = read(fd, (char*)data + done, n - done);
+        if(k <= 0) return false;
+        done += k;
+    }
+    return true;
+}
+
+/// checks the frames the parent sends and acks each, 1 when it was intact
+static int consumer(int fd, int sock)
+{
+    SharedPool* view = SharedPool::open(fd);
+    if(view == 0) return 2;
+
+    Frame f;
+    while(receiveAll(sock, &f, sizeof(f))) {
+        const unsigned char* p = (const unsigned char*)view->resolve(f.handle);
+        char ok = p != 0 && view->bufferSize(f.handle) >= f.bytes;
+        for(size_t i = 0; ok && i < f.bytes; ++i)
+            ok = p[i] == pattern(f.id, i);
+
+        // a handle into the middle of the buffer is no buffer, returning it does nothing
+        view->returnBuffer(f.handle + 1024);
+        view->returnBuffer(f.handle);
+        if(!sendAll(sock, &ok, 1)) break;
+    }
+    delete view;
+    return 0;
+}
+
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    SharedPool* pool = SharedPool::create(0, POOL_BYTES);
+    if(pool == 0) {
+        perror("SharedPool::create");
+        return 1;
+    }
+
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    pid_t child = fork();
+    if(child == 0) {
+        close(sv[0]);
+        _exit(consumer(pool->fd(), sv[1]));
+    }
+    close(sv[1]);
+
+    int intact = 0;
+    for(uint32_t id = 0; id < FRAMES; ++id) {
+        Frame f;
+        f.id = id;
+        f.bytes = 1 + (id * 7919) % (1 << 20);
+        f.handle = pool->getBuffer(f.bytes);
+        CHECK(f.handle != 0);
+        if(f.handle == 0) break;
+
+        unsigned char* p = (unsigned char*)pool->resolve(f.handle);
+        for(size_t i = 0; i < f.bytes; ++i)
+            p[i] = pattern(id, i);
+
+        char ok = 0;
+        bool sent = sendAll(sv[0], &f, sizeof(f)) && receiveAll(sv[0], &ok, 1);
+        CHECK(sent);
+        if(!sent) break;
+        CHECK(ok == 1);
+        intact += ok == 1;
+    }
+
+    close(sv[0]);
+    int status = 0;
+    waitpid(child, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // the child returned every buffer, so the parent reused them and never ran out
+    CHECK(pool->buffers() == 0);
+
+    printf("%d of %d frames intact, %zu buffers out, %zu bytes carved\n",
+           intact, (int)FRAMES, pool->buffers(), pool->carvedBytes());
+    delete pool;
+
+    printf(failures ? "FAILED\n" : "PASSED\n");
+    return failures ? 1 : 0;
+}
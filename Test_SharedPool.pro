@@ -0,0 +1,15 @@
+QMAKE_CXXFLAGS += -std=c++11 -O2
+
+OBJECTS_DIR = ./build_test_shared
+TARGET = Test_SharedPool
+
+
+HEADERS += \
+    MemAllocator.h
+
+SOURCES += \
+    Test_SharedPool.cpp \
+    MemAllocator.cpp
+
+QMAKE_LFLAGS += -Wl,--no-as-needed
+LIBS += -lpthread -ldl -lrt